@@ -11,12 +11,16 @@
 #include "ctype.h"
 
 #include "sys/socket.h"
+#include "sys/uio.h"
 // #include "libiptc/libiptc.h" // TODO use port mapping to allow capture of regular services through the network
 
 #include "arpa/inet.h"
 #include "netinet/in.h"
 
 #include "ipc.h"
+#include "tunnel.h"
+#include "latency.h"
+#include "topic.h"
 #include <stdint.h>
 
 char *local_error_string = NULL;
@@ -58,14 +62,48 @@ int open_daemon_listener(FILE *logger) {
   return daemon_socket;
 }
 
-// Attempt to send a connection request packet to a peer
-// given an address (and port) in the form of a string
+// parses a decimal port number of `port_len` characters
+//
+// on error, this functions sets errno, and local_error_string
+// and returns -1 (as oposed to 0 for success)
+int parse_port_string(const char *port_str, size_t port_len, uint16_t *port) {
+  if (port_len == 0) {
+    errno = EINVAL;
+    local_error_string = "Expected a port number";
+    return -1;
+  }
+  if (port_len > 5) {
+    errno = EINVAL;
+    local_error_string = "Port string exceeds maximum port size";
+    return -1;
+  }
+  size_t port_number = 0;
+  size_t power_of_ten = 1;
+  for (size_t i = 1; i <= port_len; i += 1) {
+    char chr = port_str[port_len-i];
+    if (!isdigit(chr)) {
+      errno = EINVAL;
+      local_error_string = "Found non-numberic character in port number";
+      return -1;
+    }
+    port_number += (chr - '0') * power_of_ten;
+    power_of_ten *= 10;
+  }
+  if (port_number > 0xffff) {
+    errno = EINVAL;
+    local_error_string = "Port number exceeds 16 bit unsigned int size";
+    return -1;
+  }
+  *port = (uint16_t)port_number;
+  return 0;
+}
+
+// parses a peer address (and port) in the form of a string
 // like would be received from the frontend
 //
 // on error, this functions sets errno, and local_error_string
 // and returns -1 (as oposed to 0 for success)
-int attemp_peer_connect_by_string(int udp_socket, char *peer_addr_str, size_t addr_len) {
-  assert(udp_socket > -1);
+int parse_peer_address_string(char *peer_addr_str, size_t addr_len, struct sockaddr_in *peer_sock_addr) {
   assert(peer_addr_str != NULL);
   if (addr_len == 0) {
     errno = EINVAL;
@@ -89,37 +127,34 @@ int attemp_peer_connect_by_string(int udp_socket, char *peer_addr_str, size_t ad
     return -1;
   }
 
+  uint16_t port_number;
   size_t port_len = addr_len - (colon_index + 1);
-  if (port_len > 5) {
-    errno = EINVAL;
-    local_error_string = "Port string exceeds maximum port size";
-    return -1;
-  }
-  size_t port_number = 0;
-  size_t power_of_ten = 1;
-  for (size_t i = 1; i <= port_len; i += 1) {
-    char chr = peer_addr_str[addr_len-i];
-    if (!isdigit(chr)) {
-      errno = EINVAL;
-      local_error_string = "Found non-numberic character in port number";
-      return -1;
-    }
-    port_number += (chr - '0') * power_of_ten;
-    power_of_ten *= 10;
-  }
-  if (port_number > 0xffff) {
-    errno = EINVAL;
-    local_error_string = "Port number exceeds 16 bit unsigned int size";
+  if (parse_port_string(peer_addr_str + colon_index + 1, port_len, &port_number) == -1) {
     return -1;
   }
 
-  const char connection_message[] = "connection-init:";
-
-  struct sockaddr_in peer_sock_addr = {
+  *peer_sock_addr = (struct sockaddr_in){
     .sin_family = AF_INET,
     .sin_addr = peer_address,
     .sin_port = port_number,
   };
+  return 0;
+}
+
+// Attempt to send a connection request packet to a peer
+// given an address (and port) in the form of a string
+// like would be received from the frontend
+//
+// on error, this functions sets errno, and local_error_string
+// and returns -1 (as oposed to 0 for success)
+int attemp_peer_connect_by_string(int udp_socket, char *peer_addr_str, size_t addr_len) {
+  assert(udp_socket > -1);
+  struct sockaddr_in peer_sock_addr;
+  if (parse_peer_address_string(peer_addr_str, addr_len, &peer_sock_addr) == -1) {
+    return -1;
+  }
+
+  const char connection_message[] = "connection-init:";
 
   ssize_t write_size = sendto(
     udp_socket, connection_message, sizeof(connection_message), 0x0,
@@ -140,6 +175,14 @@ typedef enum {
   FRONT_CMD_ECHO,
   FRONT_CMD_CONNECT,
   FRONT_CMD_PRINT,
+  FRONT_CMD_TUNNEL,
+  FRONT_CMD_TUNNELS,
+  FRONT_CMD_UNTUNNEL,
+  FRONT_CMD_NEAREST,
+  FRONT_CMD_SUBSCRIBE,
+  FRONT_CMD_UNSUBSCRIBE,
+  FRONT_CMD_PUBLISH,
+  FRONT_CMD_TOPICS,
 } FrontendCommandType;
 
 typedef struct {
@@ -192,6 +235,34 @@ int read_frontend_packet(int fd, FILE *logger, FrontendCommand *returned_command
     returned_command->cmd_type = FRONT_CMD_PRINT;
     returned_command->body = frontend_packet_buffer + 6;
     returned_command->body_len = read_size - 6;
+  }else if (strncmp("tunnel:", frontend_packet_buffer, 7) == 0) {
+    returned_command->cmd_type = FRONT_CMD_TUNNEL;
+    returned_command->body = frontend_packet_buffer + 7;
+    returned_command->body_len = read_size - 7;
+  }else if (strncmp("tunnels:", frontend_packet_buffer, 8) == 0) {
+    returned_command->cmd_type = FRONT_CMD_TUNNELS;
+  }else if (strncmp("untunnel:", frontend_packet_buffer, 9) == 0) {
+    returned_command->cmd_type = FRONT_CMD_UNTUNNEL;
+    returned_command->body = frontend_packet_buffer + 9;
+    returned_command->body_len = read_size - 9;
+  }else if (strncmp("nearest:", frontend_packet_buffer, 8) == 0) {
+    returned_command->cmd_type = FRONT_CMD_NEAREST;
+    returned_command->body = frontend_packet_buffer + 8;
+    returned_command->body_len = read_size - 8;
+  }else if (strncmp("subscribe:", frontend_packet_buffer, 10) == 0) {
+    returned_command->cmd_type = FRONT_CMD_SUBSCRIBE;
+    returned_command->body = frontend_packet_buffer + 10;
+    returned_command->body_len = read_size - 10;
+  }else if (strncmp("unsubscribe:", frontend_packet_buffer, 12) == 0) {
+    returned_command->cmd_type = FRONT_CMD_UNSUBSCRIBE;
+    returned_command->body = frontend_packet_buffer + 12;
+    returned_command->body_len = read_size - 12;
+  }else if (strncmp("publish:", frontend_packet_buffer, 8) == 0) {
+    returned_command->cmd_type = FRONT_CMD_PUBLISH;
+    returned_command->body = frontend_packet_buffer + 8;
+    returned_command->body_len = read_size - 8;
+  }else if (strncmp("topics:", frontend_packet_buffer, 7) == 0) {
+    returned_command->cmd_type = FRONT_CMD_TOPICS;
   }else {
     fprintf(stderr, "WARN: unmatch packet command -> %s\n", frontend_packet_buffer);
   }
@@ -200,7 +271,7 @@ int read_frontend_packet(int fd, FILE *logger, FrontendCommand *returned_command
 }
 
 // returns -1 on error, positive fd on success
-int open_udp_server(FILE *logger) {
+int open_udp_server(uint16_t port, FILE *logger) {
   int listener = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
   if (listener == -1) {
     if (logger != NULL) { fprintf(logger, "Failed to open udp socket -> %s\n", strerror(errno)); }
@@ -208,16 +279,55 @@ int open_udp_server(FILE *logger) {
   }
 
   struct sockaddr_in bind_address = {
-    .sin_port = 12000,
+    .sin_port = port,
     .sin_addr = INADDR_ANY,
     .sin_family = AF_INET,
   };
   int bind_result = bind(listener, (struct sockaddr *)&bind_address, sizeof(struct sockaddr_in));
   if (bind_result == -1) {
-    if (logger != NULL) { fprintf(logger, "Failed to bind udp socket to 0.0.0.0:12000 -> %s\n", strerror(errno)); }
+    if (logger != NULL) { fprintf(logger, "Failed to bind udp socket to 0.0.0.0:%u -> %s\n", port, strerror(errno)); }
     return -1;
   }
 
+  // tunnel streams may each have a full window of data in flight, and the
+  // default receive buffer drops datagrams long before that
+  //
+  // the kernel charges every datagram (including the acks) with its whole
+  // allocation, which on loopback takes about as much again as the payload
+  // of a tunnel, so twice the payload is requested
+  //
+  // SO_RCVBUF is silently capped at net.core.rmem_max, SO_RCVBUFFORCE is not
+  // but needs CAP_NET_ADMIN
+  int tunnel_payload_size = TUNNEL_STREAMS_MAX * TUNNEL_STREAM_WINDOW;
+  int receive_buffer_size = 2 * tunnel_payload_size;
+  if (setsockopt(listener, SOL_SOCKET, SO_RCVBUFFORCE, &receive_buffer_size, sizeof(receive_buffer_size)) == -1) {
+    if (setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size)) == -1 && logger != NULL) {
+      fprintf(logger, "WARN: failed to grow the udp receive buffer -> %s\n", strerror(errno));
+    }
+  }
+  // the kernel reports double the size it was asked for (the other half is
+  // for its bookkeeping), and half of the rest goes to the datagram overhead
+  int granted_size = 0;
+  socklen_t granted_size_len = sizeof(granted_size);
+  if (getsockopt(listener, SOL_SOCKET, SO_RCVBUF, &granted_size, &granted_size_len) == -1) {
+    if (logger != NULL) { fprintf(logger, "WARN: failed to read the udp receive buffer size -> %s\n", strerror(errno)); }
+  }else {
+    int granted_payload_size = granted_size / 4;
+    if (granted_payload_size < tunnel_payload_size && logger != NULL) {
+      fprintf(
+        logger,
+        "WARN: the udp receive buffer is limited to %d bytes instead of %d, tunnels are throttled to "
+        "%d bytes in flight (raise net.core.rmem_max or run with CAP_NET_ADMIN)\n",
+        granted_size / 2, receive_buffer_size, granted_payload_size
+      );
+    }
+    tunnel_set_receive_buffer((size_t)granted_payload_size);
+  }
+
+  // the peer latency estimates are only as good as these timestamps, but the
+  // daemon still works (with userspace timestamps) without them
+  latency_enable_timestamps(listener, logger);
+
   return listener;
 }
 
@@ -225,20 +335,37 @@ int open_udp_server(FILE *logger) {
 //
 // replaces `buffer_len` with the number of bytes read
 // replaces `client_addr` with the address of the client from which the packet was received
-int read_udp_packet(int fd, void *buffer, size_t *buffer_len, struct sockaddr_in *client_addr, FILE *logger) {
+// replaces `receive_time_ns` with the kernel receive timestamp of the packet (0 if it has none)
+int read_udp_packet(
+  int fd, void *buffer, size_t *buffer_len, struct sockaddr_in *client_addr,
+  uint64_t *receive_time_ns, FILE *logger
+) {
   
   // struct sockaddr_in client_addr = { .sin_family = AF_INET };
   *client_addr = (struct sockaddr_in){ .sin_family = AF_INET };
-  socklen_t addr_len = sizeof(*client_addr);
-  ssize_t read_size = recvfrom(fd, buffer, *buffer_len, 0x0, (struct sockaddr *)client_addr, &addr_len);
+  union {
+    struct cmsghdr align;
+    char buffer[256];
+  } control;
+  struct iovec iov = { .iov_base = buffer, .iov_len = *buffer_len };
+  struct msghdr message = {
+    .msg_name = client_addr,
+    .msg_namelen = sizeof(*client_addr),
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+    .msg_controllen = sizeof(control.buffer),
+  };
+  ssize_t read_size = recvmsg(fd, &message, 0x0);
 
   if (read_size == -1) {
     // fprintf(stderr, "FATAL: failed call to recvfrom -> %s\n", strerror(errno));
-    if (logger != NULL) { fprintf(logger, "Failed call to recvfrom -> %s\n", strerror(errno)); }
+    if (logger != NULL) { fprintf(logger, "Failed call to recvmsg -> %s\n", strerror(errno)); }
     return -1;
   }
 
   *buffer_len = (size_t)read_size;
+  *receive_time_ns = latency_receive_timestamp(&message);
   return 0;
 }
 
@@ -254,13 +381,101 @@ bool array_contains_sockaddr(Peer *peer_array, size_t peer_count, struct sockadd
   return false;
 }
 
-int main() {
+// Ask a connected peer to expose one of our local services, given a string
+// like would be received from the frontend
+//   <address:port> <service_port> <listen_port> [tcp|udp]
+//
+// on error, this functions sets errno, and local_error_string
+// and returns -1 (as oposed to the tunnel id for success)
+int attempt_tunnel_expose_by_string(
+  int udp_socket, char *body, size_t body_len, Peer *peer_array, size_t peer_count
+) {
+  char *fields[4] = { 0 };
+  size_t field_lens[4] = { 0 };
+  size_t field_count = 0;
+  for (size_t i = 0; i < body_len; i += 1) {
+    if (body[i] == ' ') { continue; }
+    if (field_count == 4) {
+      errno = EINVAL;
+      local_error_string = "Too many arguments, expected <address:port> <service_port> <listen_port> [tcp|udp]";
+      return -1;
+    }
+    fields[field_count] = body + i;
+    while (i < body_len && body[i] != ' ') { i += 1; }
+    field_lens[field_count] = (size_t)(body + i - fields[field_count]);
+    field_count += 1;
+  }
+  if (field_count < 3) {
+    errno = EINVAL;
+    local_error_string = "Expected <address:port> <service_port> <listen_port> [tcp|udp]";
+    return -1;
+  }
+
+  struct sockaddr_in peer;
+  uint16_t service_port, listen_port;
+  if (
+    parse_peer_address_string(fields[0], field_lens[0], &peer) == -1
+    || parse_port_string(fields[1], field_lens[1], &service_port) == -1
+    || parse_port_string(fields[2], field_lens[2], &listen_port) == -1
+  ) { return -1; }
+
+  TunnelProtocol protocol = TUNNEL_PROTO_TCP;
+  if (field_count == 4) {
+    if (field_lens[3] == 3 && strncmp(fields[3], "udp", 3) == 0) {
+      protocol = TUNNEL_PROTO_UDP;
+    }else if (field_lens[3] != 3 || strncmp(fields[3], "tcp", 3) != 0) {
+      errno = EINVAL;
+      local_error_string = "Expected the tunnel protocol to be `tcp` or `udp`";
+      return -1;
+    }
+  }
+
+  if (!array_contains_sockaddr(peer_array, peer_count, &peer)) {
+    errno = ENOTCONN;
+    local_error_string = "Tunnels can only be exposed on connected peers";
+    return -1;
+  }
+
+  int tunnel_id = tunnel_expose(udp_socket, &peer, protocol, service_port, listen_port, stderr);
+  if (tunnel_id == -1) {
+    local_error_string = errno == ENOSPC ? "The tunnel limit has been reached" : NULL;
+    return -1;
+  }
+  return tunnel_id;
+}
+
+// sends `message` to the frontend prefixed with "errlog:"
+void send_frontend_error(int daemon_socket, const char *message) {
+  char error_buffer[256];
+  int error_len = snprintf(error_buffer, sizeof(error_buffer), "errlog:%s", message);
+  assert(error_len > 0);
+  if ((size_t)error_len >= sizeof(error_buffer)) { error_len = sizeof(error_buffer) - 1; }
+  ssize_t write_size = sendto(
+    daemon_socket, error_buffer, (size_t)error_len + 1, 0x0,
+    (struct sockaddr *)&frontend_socket_addr, sizeof(frontend_socket_addr)
+  );
+  if (write_size == -1) {
+    fprintf(stderr, "Failed to send error packket to client -> %s\n", strerror(errno));
+  }
+}
+
+int main(int argc, char **argv) {
   init_ipc();
 
-  int listener = open_udp_server(stderr);
+  // the udp port can be overriden (e.g. to run several daemons on one host)
+  uint16_t udp_port = 12000;
+  if (argc > 1) {
+    local_error_string = NULL;
+    if (parse_port_string(argv[1], strlen(argv[1]), &udp_port) == -1) {
+      fprintf(stderr, "FATAL: invalid udp port `%s` -> %s\n", argv[1], local_error_string);
+      return EXIT_FAILURE;
+    }
+  }
+
+  int listener = open_udp_server(udp_port, stderr);
   int daemon_listener = open_daemon_listener(stderr);
 
-  fprintf(stdout, "INFO: servering at 0.0.0.0:12000\n");
+  fprintf(stdout, "INFO: servering at 0.0.0.0:%u\n", udp_port);
 
   #define ACTIVE_PEERS_MAX 32
   Peer active_peers[ACTIVE_PEERS_MAX];
@@ -269,19 +484,29 @@ int main() {
   char packet_buffer[0xffff]; // max size of udp packet is the max size of a uint16_t
   // char msg_name_buffer[256];
 
-  struct pollfd file_descriptors[34] = {
+  // the daemon sockets followed by the local sockets of every tunnel
+  #define POLL_FDS_MAX (2 + TUNNELS_MAX + TUNNEL_STREAMS_MAX)
+  struct pollfd file_descriptors[POLL_FDS_MAX] = {
     (struct pollfd) { .fd = daemon_listener, .events = POLLIN },
     (struct pollfd) { .fd = listener, .events = POLLIN },
   };
-  // const size_t file_descriptor_count = sizeof(file_descriptors) / sizeof(struct pollfd);
-  const size_t file_descriptor_count = 2;
   
   while (true) {
+    // pings the peers that are due, and sleeps until the next ones are
+    int poll_timeout = latency_tick(listener, stderr);
+    // the pings wake the loop at least once per second
+    tunnel_tick(listener, stderr);
+    topic_tick(listener, stderr);
+
+    // the tunnel sockets change from iteration to iteration
+    const size_t file_descriptor_count = 2 + tunnel_fill_pollfds(file_descriptors + 2, POLL_FDS_MAX - 2);
     for (size_t i = 0; i < file_descriptor_count; i += 1) {
       file_descriptors[i].revents = 0;
     }
-    int event_count = poll(file_descriptors, file_descriptor_count, -1);
-    assert(event_count != 0); // impossible with current (infinite) timeout
+    int event_count = poll(file_descriptors, file_descriptor_count, poll_timeout);
+    if (event_count == 0) { continue; }
+
+    tunnel_handle_pollfds(listener, file_descriptors + 2, file_descriptor_count - 2, stderr);
 
     if (file_descriptors[0].revents != 0) {
       FrontendCommand cmd;
@@ -389,12 +614,150 @@ int main() {
               assert((size_t)write_size == message_len + 1);
             }
           }; break;
+          case FRONT_CMD_TUNNEL: {
+            local_error_string = NULL;
+            int tunnel_id = attempt_tunnel_expose_by_string(
+              listener, cmd.body, cmd.body_len, active_peers, active_peer_count
+            );
+            if (tunnel_id == -1) {
+              if (local_error_string != NULL) {
+                fprintf(stderr, "Failed to expose tunnel -> %s\n", local_error_string);
+              }else {
+                fprintf(stderr, "Failed to expose tunnel -> %s\n", strerror(errno));
+              }
+              send_frontend_error(daemon_listener, "Failed to expose tunnel on peer");
+            }else {
+              fprintf(stdout, "INFO: requested tunnel %d from peer\n", tunnel_id);
+            }
+          }; break;
+          case FRONT_CMD_TUNNELS: {
+            char tunnels_cmd_buffer[FRONTEND_PACKET_BUFFER_SIZE];
+            const char message_prefix[] = "tunnels:";
+            size_t message_len = strlen(message_prefix);
+            memcpy(tunnels_cmd_buffer, message_prefix, message_len);
+            message_len += tunnel_format_stats(
+              tunnels_cmd_buffer + message_len, sizeof(tunnels_cmd_buffer) - message_len
+            );
+
+            ssize_t write_size = sendto(
+              daemon_listener, tunnels_cmd_buffer, message_len + 1, 0x0,
+              (struct sockaddr *)&frontend_socket_addr, SUN_LEN(&frontend_socket_addr)
+            );
+            if (write_size == -1) {
+              fprintf(stderr, "Failed to write result of tunnels: command to frontend socket -> %s\n", strerror(errno));
+            }
+          }; break;
+          case FRONT_CMD_UNTUNNEL: {
+            char *end = NULL;
+            unsigned long tunnel_id = strtoul(cmd.body, &end, 10);
+            if (end == cmd.body || tunnel_id > UINT32_MAX) {
+              fprintf(stderr, "WARN: invalid tunnel id for untunnel: command -> %s\n", cmd.body);
+              send_frontend_error(daemon_listener, "Expected the id of an exposed tunnel");
+            }else if (tunnel_unexpose(listener, (uint32_t)tunnel_id) == -1) {
+              fprintf(stderr, "Failed to close tunnel %lu -> %s\n", tunnel_id, strerror(errno));
+              send_frontend_error(daemon_listener, "No tunnel with this id was exposed by this daemon");
+            }else {
+              fprintf(stdout, "INFO: closed tunnel %lu\n", tunnel_id);
+            }
+          }; break;
+          case FRONT_CMD_NEAREST: {
+            // defaults to every live peer
+            size_t k = ACTIVE_PEERS_MAX;
+            if (cmd.body_len != 0) {
+              char *end = NULL;
+              k = strtoul(cmd.body, &end, 10);
+              if (end == cmd.body) {
+                fprintf(stderr, "WARN: invalid peer count for nearest: command -> %s\n", cmd.body);
+                k = ACTIVE_PEERS_MAX;
+              }
+            }
+            PeerLatency nearest[LATENCY_PEERS_MAX];
+            size_t nearest_count = latency_nearest_peers(k, nearest);
+
+            // "xxx.xxx.xxx.xxx:xxxxx rtt <srtt> us (min <min> us, var <rttvar> us)\n"
+            // stays well below 96 characters per peer
+            char nearest_cmd_buffer[96 * LATENCY_PEERS_MAX + 16];
+            const char message_prefix[] = "nearest:";
+            size_t message_len = strlen(message_prefix);
+            memcpy(nearest_cmd_buffer, message_prefix, message_len);
+            for (size_t i = 0; i < nearest_count; i += 1) {
+              PeerLatency *peer = &nearest[i];
+              int write_size = snprintf(
+                nearest_cmd_buffer + message_len, sizeof(nearest_cmd_buffer) - message_len,
+                IPV4_ADDR_FMT " rtt %.1f us (min %.1f us, var %.1f us)\n",
+                IPV4_ADDR_FMT_ARGS(peer->address.sin_addr.s_addr, peer->address.sin_port),
+                (double)peer->srtt_ns / 1e3, (double)peer->min_rtt_ns / 1e3, (double)peer->rttvar_ns / 1e3
+              );
+              assert(write_size > -1);
+              assert((size_t)write_size < sizeof(nearest_cmd_buffer) - message_len);
+              message_len += write_size;
+            }
+            nearest_cmd_buffer[message_len] = '\0';
+
+            ssize_t write_size = sendto(
+              daemon_listener, nearest_cmd_buffer, message_len + 1, 0x0,
+              (struct sockaddr *)&frontend_socket_addr, SUN_LEN(&frontend_socket_addr)
+            );
+            if (write_size == -1) {
+              fprintf(stderr, "Failed to write result of nearest: command to frontend socket -> %s\n", strerror(errno));
+            }
+          }; break;
+          case FRONT_CMD_SUBSCRIBE:
+          case FRONT_CMD_UNSUBSCRIBE: {
+            bool subscribe = cmd.cmd_type == FRONT_CMD_SUBSCRIBE;
+            int result = subscribe
+              ? topic_subscribe(listener, cmd.body, cmd.body_len, &cmd.client_addr, stderr)
+              : topic_unsubscribe(listener, cmd.body, cmd.body_len, &cmd.client_addr, stderr);
+            if (result == -1) {
+              fprintf(stderr, "Failed to %s topic `%s` -> %s\n", subscribe ? "subscribe to" : "unsubscribe from", cmd.body, strerror(errno));
+              send_frontend_error(daemon_listener, subscribe ? "Failed to subscribe to topic" : "Failed to unsubscribe from topic");
+            }else {
+              fprintf(stdout, "INFO: frontend %s topic `%s`\n", subscribe ? "subscribed to" : "unsubscribed from", cmd.body);
+            }
+          }; break;
+          case FRONT_CMD_PUBLISH: {
+            char *space_pointer = memchr(cmd.body, ' ', cmd.body_len);
+            size_t topic_len = space_pointer == NULL ? cmd.body_len : (size_t)(space_pointer - cmd.body);
+            size_t payload_offset = space_pointer == NULL ? cmd.body_len : topic_len + 1;
+            int result = topic_publish(
+              listener, daemon_listener, cmd.body, topic_len,
+              cmd.body + payload_offset, cmd.body_len - payload_offset, stderr
+            );
+            if (result == -1) {
+              fprintf(stderr, "Failed to publish message -> %s\n", strerror(errno));
+              send_frontend_error(daemon_listener, "Failed to publish message");
+            }
+          }; break;
+          case FRONT_CMD_TOPICS: {
+            char topics_cmd_buffer[FRONTEND_PACKET_BUFFER_SIZE];
+            const char message_prefix[] = "topics:";
+            size_t message_len = strlen(message_prefix);
+            memcpy(topics_cmd_buffer, message_prefix, message_len);
+            message_len += topic_format_stats(
+              topics_cmd_buffer + message_len, sizeof(topics_cmd_buffer) - message_len
+            );
+
+            ssize_t write_size = sendto(
+              daemon_listener, topics_cmd_buffer, message_len + 1, 0x0,
+              (struct sockaddr *)&frontend_socket_addr, SUN_LEN(&frontend_socket_addr)
+            );
+            if (write_size == -1) {
+              fprintf(stderr, "Failed to write result of topics: command to frontend socket -> %s\n", strerror(errno));
+            }
+          }; break;
         }
       }
     }else if (file_descriptors[1].revents != 0) {
+      // the transmit timestamps of pings are reported on the error queue
+      if (file_descriptors[1].revents & POLLERR) {
+        latency_read_error_queue(listener, stderr);
+      }
+      if (!(file_descriptors[1].revents & POLLIN)) { continue; }
+
       size_t read_bytes = sizeof(packet_buffer) - 1;
       struct sockaddr_in client_address;
-      int result = read_udp_packet(listener, packet_buffer, &read_bytes, &client_address, stderr);
+      uint64_t receive_time_ns;
+      int result = read_udp_packet(listener, packet_buffer, &read_bytes, &client_address, &receive_time_ns, stderr);
       if (result == -1) {
         fprintf(stderr, "Error on udp socket - continuing");
         continue;
@@ -418,6 +781,7 @@ int main() {
             .recv_port = client_address.sin_port
           };
           active_peer_count += 1;
+          latency_add_peer(&client_address);
 
           const char response[] = "connection-ack:";
           // ssize_t write_size = sendto(
@@ -433,6 +797,8 @@ int main() {
           }else {
             assert(write_size == sizeof(response));
           }
+          // only after the ack, the peer drops topic packets until it has it
+          topic_add_peer(listener, &client_address, stderr);
         }
       }else if (strncmp("connection-ack:", packet_buffer, 15) == 0) {
         fprintf(stderr, "INFO: received peer connection acknowledgement packet\n");
@@ -446,7 +812,27 @@ int main() {
             .recv_port = client_address.sin_port
           };
           active_peer_count += 1;
+          latency_add_peer(&client_address);
+          topic_add_peer(listener, &client_address, stderr);
+        }
+      }else if (strncmp("tunnel-", packet_buffer, 7) == 0) {
+        if (!array_contains_sockaddr(active_peers, active_peer_count, &client_address)) {
+          fprintf(stderr, "WARN: received a tunnel packet from an unconnected peer\n");
+          continue;
+        }
+        tunnel_handle_peer_packet(listener, packet_buffer, read_bytes, &client_address, stderr);
+      }else if (strncmp("peer-", packet_buffer, 5) == 0) {
+        if (!array_contains_sockaddr(active_peers, active_peer_count, &client_address)) {
+          fprintf(stderr, "WARN: received a ping packet from an unconnected peer\n");
+          continue;
+        }
+        latency_handle_peer_packet(listener, packet_buffer, read_bytes, &client_address, receive_time_ns, stderr);
+      }else if (strncmp("topic-", packet_buffer, 6) == 0) {
+        if (!array_contains_sockaddr(active_peers, active_peer_count, &client_address)) {
+          fprintf(stderr, "WARN: received a topic packet from an unconnected peer\n");
+          continue;
         }
+        topic_handle_peer_packet(listener, daemon_listener, packet_buffer, read_bytes, &client_address, stderr);
       }else {
         fprintf(stderr, "WARN: unhandled/invalid packet header from peer -> %s\n", packet_buffer);
       }
@@ -456,6 +842,7 @@ int main() {
   }
   AFTER_MAINLOOP: {};
 
+  tunnel_shutdown(listener);
   close(listener);
   close(daemon_listener);
   unlink(daemon_socket_path);
@@ -7,6 +7,7 @@
 #include "unistd.h"
 #include "assert.h"
 #include "poll.h"
+#include "time.h"
 
 #include "sys/socket.h"
 #include "sys/un.h"
@@ -23,6 +24,119 @@ ssize_t str_find(const char *source, size_t source_len, char delim) {
   return -1;
 }
 
+// reads the `published` and `received` counters of `topic` from the `topics:`
+// reply of the daemon, both stay 0 when the daemon does not know the topic
+// (other packets that arrive meanwhile are dropped)
+//
+// returns -1 on error, 0 on success
+int read_topic_counters(
+  int daemon_socket, const char *topic, unsigned long long *published, unsigned long long *received
+) {
+  *published = 0;
+  *received = 0;
+  ssize_t write_size = sendto(
+    daemon_socket, "topics:", 7, 0x0,
+    (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+  );
+  if (write_size == -1) {
+    fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+    return -1;
+  }
+
+  char reply[4096];
+  while (true) {
+    struct pollfd daemon_pollfd = { .fd = daemon_socket, .events = POLLIN };
+    int poll_result = poll(&daemon_pollfd, 1, 2000);
+    if (poll_result <= 0) {
+      fprintf(stderr, "Failed to read the topics of the daemon -> %s\n", poll_result == 0 ? "timed out" : strerror(errno));
+      return -1;
+    }
+    ssize_t read_size = recv(daemon_socket, reply, sizeof(reply) - 1, 0x0);
+    if (read_size == -1) {
+      fprintf(stderr, "Failed to read from UNIX socket at %s -> %s\n", daemon_socket_path, strerror(errno));
+      return -1;
+    }
+    reply[read_size] = '\0';
+    if (strncmp("topics:", reply, 7) == 0) { break; }
+  }
+
+  // "<topic> id <id> local <n> peers <n> published <n> received <n>\n"
+  size_t topic_len = strlen(topic);
+  for (char *line = reply + 7; *line != '\0'; line = strchr(line, '\n') + 1) {
+    if (strncmp(topic, line, topic_len) == 0 && line[topic_len] == ' ') {
+      sscanf(line + topic_len, " id %*x local %*d peers %*d published %llu received %llu", published, received);
+      break;
+    }
+    if (strchr(line, '\n') == NULL) { break; }
+  }
+  return 0;
+}
+
+#define PUBLISH_BENCHMARK_COUNT_MAX 10000000
+
+// Publishes `<count>` messages of `<size>` bytes on `<topic>` through the
+// daemon socket, like any other frontend would, given the arguments of the
+//   pubbench <topic> <count> <size>
+// command, and prints the throughput and how many messages the daemon published
+//
+// returns -1 on error, 0 on success
+int run_publish_benchmark(int daemon_socket, const char *arguments) {
+  // the daemon reads at most 4095 bytes per command
+  char message[4095];
+  char topic[65];
+  size_t count, size;
+  // 64 == TOPIC_NAME_MAX of the daemon
+  if (sscanf(arguments, "%64s %zu %zu", topic, &count, &size) != 3) {
+    fprintf(stderr, "Error: expected pubbench <topic> <count> <size>\n");
+    return -1;
+  }
+  int header_len = snprintf(message, sizeof(message), "publish:%s ", topic);
+  assert(header_len > 0);
+  // %zu also accepts negative numbers (which wrap around), they end up here too
+  if (size > sizeof(message) - (size_t)header_len || count > PUBLISH_BENCHMARK_COUNT_MAX) {
+    fprintf(
+      stderr, "Error: the benchmark sends at most %d messages of at most %zu bytes\n",
+      PUBLISH_BENCHMARK_COUNT_MAX, sizeof(message) - (size_t)header_len
+    );
+    return -1;
+  }
+  memset(message + header_len, 'x', size);
+  size_t message_len = (size_t)header_len + size;
+
+  unsigned long long published_before, published_after, received;
+  if (read_topic_counters(daemon_socket, topic, &published_before, &received) == -1) { return -1; }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < count; i += 1) {
+    // blocks while the daemon is behind, so this measures what it keeps up with
+    ssize_t write_size = sendto(
+      daemon_socket, message, message_len, 0x0,
+      (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+    );
+    if (write_size == -1) {
+      fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // the daemon handles the topics: command after every message sent before it
+  if (read_topic_counters(daemon_socket, topic, &published_after, &received) == -1) { return -1; }
+
+  double elapsed_s = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  if (elapsed_s <= 0) { elapsed_s = 1e-9; }
+  fprintf(
+    stdout,
+    "INFO: sent %zu messages of %zu bytes in %.3f s -> %.0f msg/s, %.2f MiB/s\n"
+    "INFO: the daemon published %llu of them (compare with `received` in `topics` on the subscribing daemons)\n",
+    count, size, elapsed_s, (double)count / elapsed_s,
+    (double)count * (double)size / elapsed_s / (1024 * 1024),
+    published_after - published_before
+  );
+  return 0;
+}
+
 
 int main() {
 
@@ -128,6 +242,82 @@ int main() {
           continue;
         }
         assert(write_size == 6);
+      }else if (strncmp("tunnel ", stdin_buffer, 7) == 0) {
+        stdin_buffer[6] = ':';
+
+        ssize_t write_size = sendto(
+          daemon_socket, stdin_buffer, input_read_size, 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
+        assert(write_size == input_read_size);
+
+        fprintf(stdout, "Sent tunnel command to server\n");
+      }else if (strncmp("untunnel ", stdin_buffer, 9) == 0) {
+        stdin_buffer[8] = ':';
+
+        ssize_t write_size = sendto(
+          daemon_socket, stdin_buffer, input_read_size, 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
+        assert(write_size == input_read_size);
+      }else if (strcmp("tunnels", stdin_buffer) == 0) {
+        ssize_t write_size = sendto(
+          daemon_socket, "tunnels:", 8, 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
+        assert(write_size == 8);
+      }else if (
+        strncmp("subscribe ", stdin_buffer, 10) == 0
+        || strncmp("unsubscribe ", stdin_buffer, 12) == 0
+        || strncmp("publish ", stdin_buffer, 8) == 0
+      ) {
+        // the command name ends at the first space
+        stdin_buffer[str_find(stdin_buffer, input_read_size, ' ')] = ':';
+
+        ssize_t write_size = sendto(
+          daemon_socket, stdin_buffer, input_read_size, 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
+        assert(write_size == input_read_size);
+      }else if (strncmp("pubbench ", stdin_buffer, 9) == 0) {
+        run_publish_benchmark(daemon_socket, stdin_buffer + 9);
+      }else if (strcmp("topics", stdin_buffer) == 0) {
+        ssize_t write_size = sendto(
+          daemon_socket, "topics:", 7, 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
+        assert(write_size == 7);
+      }else if (strcmp("nearest", stdin_buffer) == 0 || strncmp("nearest ", stdin_buffer, 8) == 0) {
+        stdin_buffer[7] = ':';
+
+        ssize_t write_size = sendto(
+          daemon_socket, stdin_buffer, 8 + (input_read_size > 8 ? input_read_size - 8 : 0), 0x0,
+          (struct sockaddr *)&daemon_socket_addr, SUN_LEN(&daemon_socket_addr)
+        );
+        if (write_size == -1) {
+          fprintf(stderr, "Failed to send packet to daemon -> %s\n", strerror(errno));
+          continue;
+        }
       }
       else {
         fprintf(stdout,
@@ -135,6 +325,19 @@ int main() {
           "echo <string> - tell the server to echo the message immediately following `echo `\n"
           "quit - tell the daemon to terminate\n"
           "connect <address:port> - attempt to connect to a peer\n"
+          "print - list the connected peers\n"
+          "tunnel <address:port> <service_port> <listen_port> [tcp|udp] - expose the local\n"
+          "    service on `service_port` on the connected peer at `address:port`, which\n"
+          "    listens for it on `listen_port`\n"
+          "tunnels - show the tunnels with their throughput and forwarding latency\n"
+          "untunnel <id> - close a tunnel exposed by this daemon (see `tunnels`)\n"
+          "nearest [k] - list the k (default all) live peers with the lowest latency\n"
+          "subscribe <topic> - receive the messages published on `topic` (here or on a peer)\n"
+          "unsubscribe <topic> - stop receiving the messages published on `topic`\n"
+          "publish <topic> <message> - publish `message` to the subscribers of `topic`\n"
+          "topics - list the known topics with their subscribers and message counts\n"
+          "pubbench <topic> <count> <size> - publish `count` messages on `topic` and measure\n"
+          "    how fast the daemon takes them\n"
         );
       }
     }
@@ -160,6 +363,22 @@ int main() {
         fprintf(stdout, "INFO: received print result from daemon\n");
         fwrite(daemon_read_buffer + 6, 1, read_size - 6, stdout);
         fprintf(stdout, "\n");
+      }else if (strncmp("message:", daemon_read_buffer, 8) == 0) {
+        fprintf(stdout, "MESSAGE: ");
+        fwrite(daemon_read_buffer + 8, 1, read_size - 8, stdout);
+        fprintf(stdout, "\n");
+      }else if (strncmp("topics:", daemon_read_buffer, 7) == 0) {
+        fprintf(stdout, "INFO: received topics from daemon\n");
+        fwrite(daemon_read_buffer + 7, 1, read_size - 7, stdout);
+        fprintf(stdout, "\n");
+      }else if (strncmp("nearest:", daemon_read_buffer, 8) == 0) {
+        fprintf(stdout, "INFO: received nearest peers from daemon\n");
+        fwrite(daemon_read_buffer + 8, 1, read_size - 8, stdout);
+        fprintf(stdout, "\n");
+      }else if (strncmp("tunnels:", daemon_read_buffer, 8) == 0) {
+        fprintf(stdout, "INFO: received tunnel statistics from daemon\n");
+        fwrite(daemon_read_buffer + 8, 1, read_size - 8, stdout);
+        fprintf(stdout, "\n");
       }else {
         fprintf(stdout, "WARN: received packet from server with a missing or misformatted message type\n");
         fwrite(daemon_read_buffer, 1, read_size, stdout);
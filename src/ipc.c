@@ -1,4 +1,6 @@
 
+#include "stdio.h"
+#include "stdlib.h"
 #include "stdbool.h"
 #include "string.h"
 #include "errno.h"
@@ -10,17 +12,27 @@
 // #include "ipc.h"
 
 
-const char *daemon_socket_path = "/tmp/kringpeers_daemon";
+#define SOCKET_PATH_MAX sizeof(((struct sockaddr_un *)0)->sun_path)
+
+char daemon_socket_path_buffer[SOCKET_PATH_MAX] = "/tmp/kringpeers_daemon";
+const char *daemon_socket_path = daemon_socket_path_buffer;
 struct sockaddr_un daemon_socket_addr = {
   .sun_family = AF_UNIX
 };
 
-const char *frontend_socket_path = "/tmp/kringpeers_frontend";
+char frontend_socket_path_buffer[SOCKET_PATH_MAX] = "/tmp/kringpeers_frontend";
+const char *frontend_socket_path = frontend_socket_path_buffer;
 struct sockaddr_un frontend_socket_addr = {
   .sun_family = AF_UNIX
 };
 
 void init_ipc() {
+  const char *instance = getenv("KRINGP_INSTANCE");
+  if (instance != NULL && instance[0] != '\0') {
+    // the paths are truncated rather than overflowing sun_path
+    snprintf(daemon_socket_path_buffer, SOCKET_PATH_MAX, "/tmp/kringpeers_daemon_%s", instance);
+    snprintf(frontend_socket_path_buffer, SOCKET_PATH_MAX, "/tmp/kringpeers_frontend_%s", instance);
+  }
   strcpy(daemon_socket_addr.sun_path, daemon_socket_path);
   strcpy(frontend_socket_addr.sun_path, frontend_socket_path);
 }
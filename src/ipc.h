@@ -2,6 +2,8 @@
 #include "sys/socket.h"
 #include "sys/un.h"
 
+// both paths get a `_<name>` suffix when the KRINGP_INSTANCE environment
+// variable is set, so several daemons (and their frontends) can share a host
 extern const char *daemon_socket_path;
 extern struct sockaddr_un daemon_socket_addr;
 
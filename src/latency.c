@@ -0,0 +1,362 @@
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "assert.h"
+#include "time.h"
+
+#include "sys/socket.h"
+#include "sys/uio.h"
+
+#include "netinet/in.h"
+#include "linux/errqueue.h"
+#include "linux/net_tstamp.h"
+
+#include "latency.h"
+
+// ping/pong packets, like the connection packets these are text
+//   "peer-ping:<ping_id>"
+//   "peer-pong:<ping_id> <turnaround_ns>"
+// where `turnaround_ns` is the time between the kernel receive timestamp of
+// the ping and the pong being sent, which is subtracted from the round trip
+
+typedef struct {
+  bool active;
+  bool live;
+  PeerLatency latency;
+  uint64_t samples;
+  uint64_t last_pong_ns; // (monotonic) when the peer last answered
+  uint64_t next_ping_ns; // (monotonic) when the peer is due for a ping
+
+  bool ping_outstanding;
+  uint64_t ping_id;
+  // OPT_ID key of the ping's transmit timestamp on the error queue
+  uint32_t ping_timestamp_key;
+  // userspace send time, replaced by the kernel timestamp once it arrives
+  uint64_t ping_send_time_ns;
+
+  size_t order_index; // position in `latency_order` while live
+} PeerLatencySlot;
+
+static PeerLatencySlot latency_peers[LATENCY_PEERS_MAX];
+// indices into `latency_peers` of every live peer, ordered by srtt
+static size_t latency_order[LATENCY_PEERS_MAX];
+static size_t live_peer_count = 0;
+
+static uint64_t next_ping_id = 1;
+// the kernel numbers (OPT_ID) only the sends that requested a timestamp,
+// and only pings do, so this mirrors the kernel's counter
+static uint32_t next_timestamp_key = 0;
+static bool transmit_timestamps_enabled = false;
+
+static uint64_t timespec_ns(struct timespec time) {
+  return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return timespec_ns(now);
+}
+
+static bool same_address(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+int latency_enable_timestamps(int udp_socket, FILE *logger) {
+  int flags =
+    SOF_TIMESTAMPING_RX_SOFTWARE
+    | SOF_TIMESTAMPING_SOFTWARE
+    | SOF_TIMESTAMPING_OPT_ID
+    | SOF_TIMESTAMPING_OPT_TSONLY;
+  // transmit timestamps are requested per packet (see send_ping), as the
+  // tunnel traffic on this socket does not need them
+  int sockopt_result = setsockopt(udp_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+  if (sockopt_result == 0) {
+    transmit_timestamps_enabled = true;
+    return 0;
+  }
+
+  if (logger != NULL) { fprintf(logger, "WARN: SO_TIMESTAMPING unavailable, falling back to SO_TIMESTAMPNS -> %s\n", strerror(errno)); }
+  int enable = 1;
+  sockopt_result = setsockopt(udp_socket, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+  if (sockopt_result == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to enable kernel timestamps -> %s\n", strerror(errno)); }
+    return -1;
+  }
+  return 0;
+}
+
+uint64_t latency_receive_timestamp(struct msghdr *message) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET) { continue; }
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping timestamps;
+      memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+      // ts[0] is the software timestamp
+      return timespec_ns(timestamps.ts[0]);
+    }else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec timestamp;
+      memcpy(&timestamp, CMSG_DATA(cmsg), sizeof(timestamp));
+      return timespec_ns(timestamp);
+    }
+  }
+  return 0;
+}
+
+void latency_read_error_queue(int udp_socket, FILE *logger) {
+  while (true) {
+    char data[64];
+    union {
+      struct cmsghdr align;
+      char buffer[256];
+    } control;
+    struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+    struct msghdr message = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+    };
+    ssize_t read_size = recvmsg(udp_socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (read_size == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && logger != NULL) {
+        fprintf(logger, "Failed to read udp socket error queue -> %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    uint64_t send_time_ns = 0;
+    struct sock_extended_err error = { 0 };
+    bool has_error = false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        struct scm_timestamping timestamps;
+        memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+        send_time_ns = timespec_ns(timestamps.ts[0]);
+      }else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+        memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+        has_error = true;
+      }
+    }
+    if (
+      !has_error || send_time_ns == 0
+      || error.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || error.ee_info != SCM_TSTAMP_SND
+    ) { continue; }
+
+    for (size_t i = 0; i < LATENCY_PEERS_MAX; i += 1) {
+      PeerLatencySlot *slot = &latency_peers[i];
+      if (slot->active && slot->ping_outstanding && slot->ping_timestamp_key == error.ee_data) {
+        slot->ping_send_time_ns = send_time_ns;
+        break;
+      }
+    }
+  }
+}
+
+static uint64_t slot_srtt(size_t slot_index) {
+  return latency_peers[slot_index].latency.srtt_ns;
+}
+
+static void order_swap(size_t a, size_t b) {
+  size_t slot_index = latency_order[a];
+  latency_order[a] = latency_order[b];
+  latency_order[b] = slot_index;
+  latency_peers[latency_order[a]].order_index = a;
+  latency_peers[latency_order[b]].order_index = b;
+}
+
+// moves the live peer at `position` to its place after its srtt changed
+// (one sample rarely moves a peer by more than a few places)
+static void order_repair(size_t position) {
+  while (position > 0 && slot_srtt(latency_order[position - 1]) > slot_srtt(latency_order[position])) {
+    order_swap(position - 1, position);
+    position -= 1;
+  }
+  while (position + 1 < live_peer_count && slot_srtt(latency_order[position + 1]) < slot_srtt(latency_order[position])) {
+    order_swap(position, position + 1);
+    position += 1;
+  }
+}
+
+static void order_insert(size_t slot_index) {
+  assert(live_peer_count < LATENCY_PEERS_MAX);
+  latency_order[live_peer_count] = slot_index;
+  latency_peers[slot_index].order_index = live_peer_count;
+  live_peer_count += 1;
+  order_repair(live_peer_count - 1);
+}
+
+static void order_remove(size_t slot_index) {
+  size_t position = latency_peers[slot_index].order_index;
+  assert(latency_order[position] == slot_index);
+  for (size_t i = position; i + 1 < live_peer_count; i += 1) {
+    latency_order[i] = latency_order[i + 1];
+    latency_peers[latency_order[i]].order_index = i;
+  }
+  live_peer_count -= 1;
+}
+
+void latency_add_peer(const struct sockaddr_in *peer) {
+  for (size_t i = 0; i < LATENCY_PEERS_MAX; i += 1) {
+    if (latency_peers[i].active && same_address(&latency_peers[i].latency.address, peer)) { return; }
+  }
+  for (size_t i = 0; i < LATENCY_PEERS_MAX; i += 1) {
+    if (latency_peers[i].active) { continue; }
+    latency_peers[i] = (PeerLatencySlot){
+      .active = true,
+      .latency = { .address = *peer },
+    };
+    return;
+  }
+}
+
+static void send_ping(int udp_socket, PeerLatencySlot *slot, FILE *logger) {
+  char ping[64];
+  int ping_len = snprintf(ping, sizeof(ping), "peer-ping:%llu", (unsigned long long)next_ping_id);
+  assert(ping_len > 0 && (size_t)ping_len < sizeof(ping));
+
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control = { 0 };
+  struct iovec iov = { .iov_base = ping, .iov_len = (size_t)ping_len + 1 };
+  struct msghdr message = {
+    .msg_name = &slot->latency.address,
+    .msg_namelen = sizeof(slot->latency.address),
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  if (transmit_timestamps_enabled) {
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+    memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+  }
+
+  uint64_t send_time_ns = clock_ns(CLOCK_REALTIME);
+  ssize_t write_size = sendmsg(udp_socket, &message, 0x0);
+  if (write_size == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to send ping to peer -> %s\n", strerror(errno)); }
+    return;
+  }
+  slot->ping_outstanding = true;
+  slot->ping_id = next_ping_id;
+  slot->ping_send_time_ns = send_time_ns;
+  next_ping_id += 1;
+  if (transmit_timestamps_enabled) {
+    slot->ping_timestamp_key = next_timestamp_key;
+    next_timestamp_key += 1;
+  }
+}
+
+int latency_tick(int udp_socket, FILE *logger) {
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  uint64_t next_due = now + (uint64_t)LATENCY_PING_INTERVAL_MS * 1000000;
+
+  for (size_t i = 0; i < LATENCY_PEERS_MAX; i += 1) {
+    PeerLatencySlot *slot = &latency_peers[i];
+    if (!slot->active) { continue; }
+
+    if (slot->live && now - slot->last_pong_ns > (uint64_t)LATENCY_PEER_TIMEOUT_MS * 1000000) {
+      slot->live = false;
+      order_remove(i);
+    }
+    if (slot->next_ping_ns <= now) {
+      // an unanswered ping is simply superseded
+      send_ping(udp_socket, slot, logger);
+      slot->next_ping_ns = now + (uint64_t)LATENCY_PING_INTERVAL_MS * 1000000;
+    }
+    if (slot->next_ping_ns < next_due) { next_due = slot->next_ping_ns; }
+  }
+
+  // rounded up, so poll does not wake up just before the ping is due
+  return (int)((next_due - now + 999999) / 1000000);
+}
+
+static void record_rtt_sample(size_t slot_index, uint64_t rtt_ns) {
+  PeerLatencySlot *slot = &latency_peers[slot_index];
+  PeerLatency *latency = &slot->latency;
+  if (slot->samples == 0) {
+    // initial values as in RFC 6298
+    latency->srtt_ns = rtt_ns;
+    latency->rttvar_ns = rtt_ns / 2;
+    latency->min_rtt_ns = rtt_ns;
+  }else {
+    uint64_t deviation = latency->srtt_ns > rtt_ns ? latency->srtt_ns - rtt_ns : rtt_ns - latency->srtt_ns;
+    latency->rttvar_ns = (latency->rttvar_ns * 3 + deviation) / 4;
+    latency->srtt_ns = (latency->srtt_ns * 7 + rtt_ns) / 8;
+    if (rtt_ns < latency->min_rtt_ns) { latency->min_rtt_ns = rtt_ns; }
+  }
+  slot->samples += 1;
+
+  if (slot->live) {
+    order_repair(slot->order_index);
+  }else {
+    slot->live = true;
+    order_insert(slot_index);
+  }
+}
+
+void latency_handle_peer_packet(
+  int udp_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, uint64_t receive_time_ns, FILE *logger
+) {
+  if (receive_time_ns == 0) { receive_time_ns = clock_ns(CLOCK_REALTIME); }
+
+  char text[64];
+  if (packet_len >= sizeof(text)) {
+    if (logger != NULL) { fprintf(logger, "WARN: oversized ping packet from peer\n"); }
+    return;
+  }
+  memcpy(text, packet, packet_len);
+  text[packet_len] = '\0';
+
+  unsigned long long ping_id, turnaround_ns;
+  if (sscanf(text, "peer-ping:%llu", &ping_id) == 1) {
+    char pong[64];
+    uint64_t now = clock_ns(CLOCK_REALTIME);
+    int pong_len = snprintf(
+      pong, sizeof(pong), "peer-pong:%llu %llu",
+      ping_id, (unsigned long long)(now > receive_time_ns ? now - receive_time_ns : 0)
+    );
+    assert(pong_len > 0 && (size_t)pong_len < sizeof(pong));
+    ssize_t write_size = sendto(
+      udp_socket, pong, (size_t)pong_len + 1, 0x0,
+      (const struct sockaddr *)peer, sizeof(*peer)
+    );
+    if (write_size == -1 && logger != NULL) {
+      fprintf(logger, "Failed to send pong to peer -> %s\n", strerror(errno));
+    }
+  }else if (sscanf(text, "peer-pong:%llu %llu", &ping_id, &turnaround_ns) == 2) {
+    for (size_t i = 0; i < LATENCY_PEERS_MAX; i += 1) {
+      PeerLatencySlot *slot = &latency_peers[i];
+      if (!slot->active || !same_address(&slot->latency.address, peer)) { continue; }
+      // late pongs of superseded pings are ignored
+      if (!slot->ping_outstanding || slot->ping_id != ping_id) { return; }
+      slot->ping_outstanding = false;
+      slot->last_pong_ns = clock_ns(CLOCK_MONOTONIC);
+
+      // the clocks (or a lying peer) can make the difference negative
+      if (receive_time_ns < slot->ping_send_time_ns + turnaround_ns) { return; }
+      record_rtt_sample(i, receive_time_ns - slot->ping_send_time_ns - turnaround_ns);
+      return;
+    }
+  }else if (logger != NULL) {
+    fprintf(logger, "WARN: invalid ping packet from peer -> %s\n", text);
+  }
+}
+
+size_t latency_nearest_peers(size_t k, PeerLatency *nearest) {
+  if (k > live_peer_count) { k = live_peer_count; }
+  for (size_t i = 0; i < k; i += 1) {
+    nearest[i] = latency_peers[latency_order[i]].latency;
+  }
+  return k;
+}
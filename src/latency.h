@@ -0,0 +1,63 @@
+
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "time.h"
+
+#include "sys/socket.h"
+#include "netinet/in.h"
+
+// Per-peer latency estimation from kernel timestamps
+//
+// Every connected peer is pinged once per LATENCY_PING_INTERVAL_MS. The round
+// trip is measured between the kernel (software) transmit timestamp of the
+// ping and the kernel receive timestamp of the pong, minus the time the peer
+// held the ping, so poll() wakeups and logging on either side do not end up
+// in the samples.
+//
+// Live peers (those that answered within LATENCY_PEER_TIMEOUT_MS) are kept
+// ordered by their smoothed rtt. The order is repaired incrementally whenever
+// a sample moves a peer, so asking for the k nearest peers costs O(k).
+
+#define LATENCY_PEERS_MAX 32
+#define LATENCY_PING_INTERVAL_MS 1000
+#define LATENCY_PEER_TIMEOUT_MS (3 * LATENCY_PING_INTERVAL_MS)
+
+typedef struct {
+  struct sockaddr_in address;
+  uint64_t srtt_ns; // smoothed round trip time
+  uint64_t rttvar_ns; // mean deviation of the round trip time
+  uint64_t min_rtt_ns;
+} PeerLatency;
+
+// enables kernel receive (and per-packet transmit) timestamps on the socket,
+// falling back to receive-only SO_TIMESTAMPNS on older kernels
+//
+// returns -1 on error, 0 on success
+int latency_enable_timestamps(int udp_socket, FILE *logger);
+
+// returns the kernel receive timestamp (CLOCK_REALTIME, in nanoseconds) from
+// the control messages of a message read with recvmsg(), or 0 if it has none
+uint64_t latency_receive_timestamp(struct msghdr *message);
+
+// reads the transmit timestamps queued on the socket's error queue
+// (call this when poll() reports POLLERR on the udp socket)
+void latency_read_error_queue(int udp_socket, FILE *logger);
+
+// starts measuring the latency of a (newly connected) peer
+void latency_add_peer(const struct sockaddr_in *peer);
+
+// pings the peers that are due and updates their liveness
+// returns the poll() timeout (in milliseconds) until the next ping is due
+int latency_tick(int udp_socket, FILE *logger);
+
+// handles a packet starting with "peer-" received from a connected peer
+// `receive_time_ns` is the value returned by latency_receive_timestamp()
+void latency_handle_peer_packet(
+  int udp_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, uint64_t receive_time_ns, FILE *logger
+);
+
+// copies (up to) the `k` lowest latency live peers into `nearest`, nearest first
+// returns the number of peers copied
+size_t latency_nearest_peers(size_t k, PeerLatency *nearest);
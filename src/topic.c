@@ -0,0 +1,483 @@
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "stdbool.h"
+#include "assert.h"
+#include "time.h"
+
+#include "sys/socket.h"
+#include "sys/uio.h"
+#include "sys/un.h"
+
+#include "arpa/inet.h"
+#include "netinet/in.h"
+
+#include "topic.h"
+
+// peer packets, the topic id is a u32 in network byte order
+//   "topic-sub:"   u32 topic_id                           (the sender has subscribers)
+//   "topic-unsub:" u32 topic_id                           (the sender has none anymore)
+//   "topic-pub:"   u32 topic_id, u8 name_len, name, payload
+// the name travels with every message so receivers can tell topics apart
+// whose names hash to the same id
+#define TOPIC_MSG_SUB   "topic-sub:"
+#define TOPIC_MSG_UNSUB "topic-unsub:"
+#define TOPIC_MSG_PUB   "topic-pub:"
+
+// messages delivered to local subscribers look like "message:<topic> <payload>"
+#define TOPIC_LOCAL_MSG "message:"
+
+// keeps the probe sequences of the (linear probing) index short
+#define TOPICS_LOAD_MAX (TOPICS_MAX / 4 * 3)
+
+typedef struct {
+  uint32_t peer_bits; // bit i: topic_peers[i] has subscribers
+  uint8_t local_bits; // bit i: local_subscribers[i] is subscribed
+} TopicRoute;
+
+typedef struct {
+  // only known for local subscriptions and topics published here, peers
+  // only send the id
+  char name[TOPIC_NAME_MAX + 1];
+  uint64_t published;
+  uint64_t received;
+} TopicInfo;
+
+// The routing index is split by temperature: probing only touches the dense
+// id array, the routes are read once per publish, and the rest is cold
+static uint32_t topic_ids[TOPICS_MAX]; // 0 marks an empty slot
+static TopicRoute topic_routes[TOPICS_MAX];
+static TopicInfo topic_info[TOPICS_MAX];
+static size_t topic_count = 0;
+
+static struct sockaddr_in topic_peers[TOPIC_PEERS_MAX];
+static size_t topic_peer_count = 0;
+
+static uint64_t next_refresh_ns = 0;
+
+static struct sockaddr_un local_subscribers[TOPIC_LOCAL_SUBSCRIBERS_MAX];
+// number of topics each local subscriber is subscribed to, 0 for a free slot
+static size_t local_subscription_counts[TOPIC_LOCAL_SUBSCRIBERS_MAX];
+
+// 32 bit FNV-1a, never 0 (which marks empty index slots)
+static uint32_t topic_hash(const char *topic, size_t topic_len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < topic_len; i += 1) {
+    hash ^= (uint8_t)topic[i];
+    hash *= 16777619u;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+static bool valid_topic_name(const char *topic, size_t topic_len) {
+  if (topic_len == 0 || topic_len > TOPIC_NAME_MAX) { return false; }
+  // spaces seperate the topic from the message in frontend commands
+  return memchr(topic, ' ', topic_len) == NULL && memchr(topic, '\0', topic_len) == NULL;
+}
+
+static bool topic_name_matches(size_t slot, const char *topic, size_t topic_len) {
+  const char *name = topic_info[slot].name;
+  return strlen(name) == topic_len && memcmp(name, topic, topic_len) == 0;
+}
+
+// returns the slot holding `id`, or the empty slot where it belongs
+static size_t topic_probe(uint32_t id) {
+  size_t slot = id & (TOPICS_MAX - 1);
+  while (topic_ids[slot] != 0 && topic_ids[slot] != id) {
+    slot = (slot + 1) & (TOPICS_MAX - 1);
+  }
+  return slot;
+}
+
+// returns the slot of `id`, inserting it if needed
+// returns -1 when the index is full
+static ssize_t topic_insert(uint32_t id) {
+  size_t slot = topic_probe(id);
+  if (topic_ids[slot] == id) { return (ssize_t)slot; }
+  if (topic_count == TOPICS_LOAD_MAX) { return -1; }
+  topic_ids[slot] = id;
+  topic_routes[slot] = (TopicRoute){ 0 };
+  topic_info[slot] = (TopicInfo){ 0 };
+  topic_count += 1;
+  return (ssize_t)slot;
+}
+
+// removes the topic in `slot`, shifting the entries after it back so that
+// lookups never need tombstones
+static void topic_remove(size_t slot) {
+  const size_t mask = TOPICS_MAX - 1;
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; topic_ids[next] != 0; next = (next + 1) & mask) {
+    size_t home = topic_ids[next] & mask;
+    // the entry may only move back if the hole lies between its home slot and itself
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      topic_ids[hole] = topic_ids[next];
+      topic_routes[hole] = topic_routes[next];
+      topic_info[hole] = topic_info[next];
+      hole = next;
+    }
+  }
+  topic_ids[hole] = 0;
+  topic_routes[hole] = (TopicRoute){ 0 };
+  topic_info[hole] = (TopicInfo){ 0 };
+  topic_count -= 1;
+}
+
+static ssize_t find_topic_peer(const struct sockaddr_in *peer) {
+  for (size_t i = 0; i < topic_peer_count; i += 1) {
+    if (
+      topic_peers[i].sin_addr.s_addr == peer->sin_addr.s_addr
+      && topic_peers[i].sin_port == peer->sin_port
+    ) { return (ssize_t)i; }
+  }
+  return -1;
+}
+
+static void send_interest(int udp_socket, const struct sockaddr_in *peer, const char *message_type, uint32_t id, FILE *logger) {
+  char packet[32];
+  size_t packet_len = strlen(message_type);
+  memcpy(packet, message_type, packet_len);
+  uint32_t network_id = htonl(id);
+  memcpy(packet + packet_len, &network_id, sizeof(network_id));
+  packet_len += sizeof(network_id);
+
+  ssize_t write_size = sendto(
+    udp_socket, packet, packet_len, 0x0,
+    (const struct sockaddr *)peer, sizeof(*peer)
+  );
+  if (write_size == -1 && logger != NULL) {
+    fprintf(logger, "Failed to send %s packet to peer -> %s\n", message_type, strerror(errno));
+  }
+}
+
+static void broadcast_interest(int udp_socket, const char *message_type, uint32_t id, FILE *logger) {
+  for (size_t i = 0; i < topic_peer_count; i += 1) {
+    send_interest(udp_socket, &topic_peers[i], message_type, id, logger);
+  }
+}
+
+// clears the local subscription bit `bit` of the topic in `slot`
+// returns true if the topic was removed from the index
+static bool clear_local_bit(int udp_socket, size_t slot, size_t bit, FILE *logger) {
+  TopicRoute *route = &topic_routes[slot];
+  assert(route->local_bits & (1u << bit));
+  route->local_bits &= ~(1u << bit);
+  local_subscription_counts[bit] -= 1;
+  if (route->local_bits != 0) { return false; }
+
+  broadcast_interest(udp_socket, TOPIC_MSG_UNSUB, topic_ids[slot], logger);
+  topic_info[slot].name[0] = '\0';
+  if (route->peer_bits != 0) { return false; }
+  topic_remove(slot);
+  return true;
+}
+
+// forgets a local subscriber that went away
+static void drop_local_subscriber(int udp_socket, size_t bit, FILE *logger) {
+  for (size_t slot = 0; slot < TOPICS_MAX && local_subscription_counts[bit] != 0;) {
+    if (
+      topic_ids[slot] != 0 && (topic_routes[slot].local_bits & (1u << bit))
+      && clear_local_bit(udp_socket, slot, bit, logger)
+    ) {
+      continue; // another entry may have shifted into this slot
+    }
+    slot += 1;
+  }
+  local_subscription_counts[bit] = 0;
+}
+
+// returns the number of local subscribers the message was delivered to
+static size_t deliver_locally(
+  int udp_socket, int unix_socket, size_t slot, const char *topic, size_t topic_len,
+  const char *payload, size_t payload_len, FILE *logger
+) {
+  size_t deliveries = 0;
+  struct iovec iov[4] = {
+    { .iov_base = TOPIC_LOCAL_MSG, .iov_len = strlen(TOPIC_LOCAL_MSG) },
+    { .iov_base = (void *)topic, .iov_len = topic_len },
+    { .iov_base = " ", .iov_len = 1 },
+    { .iov_base = (void *)payload, .iov_len = payload_len },
+  };
+  const uint32_t id = topic_ids[slot];
+  unsigned bits = topic_routes[slot].local_bits;
+  while (bits != 0) {
+    size_t bit = (size_t)__builtin_ctz(bits);
+    bits &= bits - 1;
+
+    struct msghdr message = {
+      .msg_name = &local_subscribers[bit],
+      .msg_namelen = SUN_LEN(&local_subscribers[bit]),
+      .msg_iov = iov,
+      .msg_iovlen = 4,
+    };
+    // a slow frontend loses messages rather than stalling the daemon
+    ssize_t write_size = sendmsg(unix_socket, &message, MSG_DONTWAIT);
+    if (write_size != -1) {
+      deliveries += 1;
+    }else if (errno == ENOENT || errno == ECONNREFUSED) {
+      if (logger != NULL) { fprintf(logger, "INFO: subscriber `%s` went away, dropping its subscriptions\n", local_subscribers[bit].sun_path); }
+      // this can remove (or move) the topic, so the remaining bits are
+      // looked up again (the subscribers are visited in bit order)
+      drop_local_subscriber(udp_socket, bit, logger);
+      slot = topic_probe(id);
+      if (topic_ids[slot] == 0) { break; }
+      bits = topic_routes[slot].local_bits & ~((2u << bit) - 1);
+    }else if (errno != EAGAIN && errno != EWOULDBLOCK && logger != NULL) {
+      fprintf(logger, "Failed to deliver message to subscriber -> %s\n", strerror(errno));
+    }
+  }
+  return deliveries;
+}
+
+void topic_tick(int udp_socket, FILE *logger) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+  if (now_ns < next_refresh_ns) { return; }
+  next_refresh_ns = now_ns + (uint64_t)TOPIC_REFRESH_INTERVAL_MS * 1000000;
+
+  for (size_t slot = 0; slot < TOPICS_MAX; slot += 1) {
+    if (topic_ids[slot] != 0 && topic_routes[slot].local_bits != 0) {
+      broadcast_interest(udp_socket, TOPIC_MSG_SUB, topic_ids[slot], logger);
+    }
+  }
+}
+
+void topic_add_peer(int udp_socket, const struct sockaddr_in *peer, FILE *logger) {
+  if (find_topic_peer(peer) != -1) { return; }
+  if (topic_peer_count == TOPIC_PEERS_MAX) {
+    if (logger != NULL) { fprintf(logger, "WARN: topic peer limit reached, peer will not receive published messages\n"); }
+    return;
+  }
+  topic_peers[topic_peer_count] = *peer;
+  topic_peer_count += 1;
+
+  for (size_t slot = 0; slot < TOPICS_MAX; slot += 1) {
+    if (topic_ids[slot] != 0 && topic_routes[slot].local_bits != 0) {
+      send_interest(udp_socket, peer, TOPIC_MSG_SUB, topic_ids[slot], logger);
+    }
+  }
+}
+
+int topic_subscribe(
+  int udp_socket, const char *topic, size_t topic_len,
+  const struct sockaddr_un *subscriber, FILE *logger
+) {
+  if (!valid_topic_name(topic, topic_len)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ssize_t bit = -1;
+  for (size_t i = 0; i < TOPIC_LOCAL_SUBSCRIBERS_MAX; i += 1) {
+    if (local_subscription_counts[i] != 0 && strcmp(local_subscribers[i].sun_path, subscriber->sun_path) == 0) {
+      bit = (ssize_t)i;
+      break;
+    }
+    if (bit == -1 && local_subscription_counts[i] == 0) { bit = (ssize_t)i; }
+  }
+  if (bit == -1) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  uint32_t id = topic_hash(topic, topic_len);
+  ssize_t slot = topic_insert(id);
+  if (slot == -1) {
+    errno = ENOSPC;
+    return -1;
+  }
+  TopicRoute *route = &topic_routes[slot];
+  TopicInfo *info = &topic_info[slot];
+  if (route->local_bits != 0 && !topic_name_matches((size_t)slot, topic, topic_len)) {
+    // another topic with the same hash already has local subscribers
+    errno = EEXIST;
+    return -1;
+  }
+  if (route->local_bits & (1u << bit)) { return 0; }
+
+  if (local_subscription_counts[bit] == 0) { local_subscribers[bit] = *subscriber; }
+  local_subscription_counts[bit] += 1;
+  bool had_local_subscribers = route->local_bits != 0;
+  route->local_bits |= 1u << bit;
+  if (!had_local_subscribers) {
+    memcpy(info->name, topic, topic_len);
+    info->name[topic_len] = '\0';
+    broadcast_interest(udp_socket, TOPIC_MSG_SUB, id, logger);
+  }
+  return 0;
+}
+
+int topic_unsubscribe(
+  int udp_socket, const char *topic, size_t topic_len,
+  const struct sockaddr_un *subscriber, FILE *logger
+) {
+  if (!valid_topic_name(topic, topic_len)) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t slot = topic_probe(topic_hash(topic, topic_len));
+  if (topic_ids[slot] == 0 || !topic_name_matches(slot, topic, topic_len)) {
+    errno = ENOENT;
+    return -1;
+  }
+  for (size_t bit = 0; bit < TOPIC_LOCAL_SUBSCRIBERS_MAX; bit += 1) {
+    if (
+      (topic_routes[slot].local_bits & (1u << bit))
+      && strcmp(local_subscribers[bit].sun_path, subscriber->sun_path) == 0
+    ) {
+      clear_local_bit(udp_socket, slot, bit, logger);
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int topic_publish(
+  int udp_socket, int unix_socket, const char *topic, size_t topic_len,
+  const char *payload, size_t payload_len, FILE *logger
+) {
+  if (!valid_topic_name(topic, topic_len)) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint32_t id = topic_hash(topic, topic_len);
+  size_t slot = topic_probe(id);
+  if (topic_ids[slot] == 0) { return 0; } // nobody is interested
+  topic_info[slot].published += 1;
+  if (topic_info[slot].name[0] == '\0') {
+    memcpy(topic_info[slot].name, topic, topic_len);
+    topic_info[slot].name[topic_len] = '\0';
+  }
+
+  char header[sizeof(TOPIC_MSG_PUB) + sizeof(uint32_t) + 1 + TOPIC_NAME_MAX];
+  size_t header_len = strlen(TOPIC_MSG_PUB);
+  memcpy(header, TOPIC_MSG_PUB, header_len);
+  uint32_t network_id = htonl(id);
+  memcpy(header + header_len, &network_id, sizeof(network_id));
+  header_len += sizeof(network_id);
+  header[header_len] = (char)topic_len;
+  header_len += 1;
+  memcpy(header + header_len, topic, topic_len);
+  header_len += topic_len;
+
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = header_len },
+    { .iov_base = (void *)payload, .iov_len = payload_len },
+  };
+  int deliveries = 0;
+  uint32_t bits = topic_routes[slot].peer_bits;
+  while (bits != 0) {
+    size_t peer_index = (size_t)__builtin_ctz(bits);
+    bits &= bits - 1;
+
+    struct msghdr message = {
+      .msg_name = &topic_peers[peer_index],
+      .msg_namelen = sizeof(topic_peers[peer_index]),
+      .msg_iov = iov,
+      .msg_iovlen = 2,
+    };
+    ssize_t write_size = sendmsg(udp_socket, &message, 0x0);
+    if (write_size == -1) {
+      if (logger != NULL) { fprintf(logger, "Failed to publish message to peer -> %s\n", strerror(errno)); }
+      continue;
+    }
+    deliveries += 1;
+  }
+
+  if (topic_routes[slot].local_bits != 0 && topic_name_matches(slot, topic, topic_len)) {
+    deliveries += (int)deliver_locally(udp_socket, unix_socket, slot, topic, topic_len, payload, payload_len, logger);
+  }
+  return deliveries;
+}
+
+void topic_handle_peer_packet(
+  int udp_socket, int unix_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, FILE *logger
+) {
+  ssize_t peer_index = find_topic_peer(peer);
+  if (peer_index == -1) { return; }
+
+  const char *message_type = NULL;
+  if (strncmp(TOPIC_MSG_SUB, packet, strlen(TOPIC_MSG_SUB)) == 0) {
+    message_type = TOPIC_MSG_SUB;
+  }else if (strncmp(TOPIC_MSG_UNSUB, packet, strlen(TOPIC_MSG_UNSUB)) == 0) {
+    message_type = TOPIC_MSG_UNSUB;
+  }else if (strncmp(TOPIC_MSG_PUB, packet, strlen(TOPIC_MSG_PUB)) == 0) {
+    message_type = TOPIC_MSG_PUB;
+  }
+  size_t offset = message_type == NULL ? 0 : strlen(message_type);
+  if (message_type == NULL || packet_len < offset + sizeof(uint32_t)) {
+    if (logger != NULL) { fprintf(logger, "WARN: invalid topic packet from peer\n"); }
+    return;
+  }
+  uint32_t id;
+  memcpy(&id, packet + offset, sizeof(id));
+  id = ntohl(id);
+  offset += sizeof(id);
+
+  if (strcmp(message_type, TOPIC_MSG_SUB) == 0) {
+    ssize_t slot = topic_insert(id);
+    if (slot == -1) {
+      if (logger != NULL) { fprintf(logger, "WARN: topic limit reached, ignoring peer subscription\n"); }
+      return;
+    }
+    topic_routes[slot].peer_bits |= 1u << peer_index;
+  }else if (strcmp(message_type, TOPIC_MSG_UNSUB) == 0) {
+    size_t slot = topic_probe(id);
+    if (topic_ids[slot] == 0) { return; }
+    topic_routes[slot].peer_bits &= ~(1u << peer_index);
+    if (topic_routes[slot].peer_bits == 0 && topic_routes[slot].local_bits == 0) {
+      topic_remove(slot);
+    }
+  }else {
+    if (packet_len < offset + 1) { return; }
+    size_t topic_len = (uint8_t)packet[offset];
+    offset += 1;
+    if (packet_len < offset + topic_len) { return; }
+    const char *topic = packet + offset;
+    offset += topic_len;
+
+    size_t slot = topic_probe(id);
+    if (topic_ids[slot] == 0 || topic_routes[slot].local_bits == 0) {
+      // the peer missed our unsubscription
+      send_interest(udp_socket, peer, TOPIC_MSG_UNSUB, id, logger);
+      return;
+    }
+    if (!topic_name_matches(slot, topic, topic_len)) { return; }
+    topic_info[slot].received += 1;
+    deliver_locally(
+      udp_socket, unix_socket, slot, topic, topic_len,
+      packet + offset, packet_len - offset, logger
+    );
+  }
+}
+
+size_t topic_format_stats(char *buffer, size_t buffer_size) {
+  size_t message_len = 0;
+  for (size_t slot = 0; slot < TOPICS_MAX; slot += 1) {
+    if (topic_ids[slot] == 0) { continue; }
+    if (message_len >= buffer_size) { break; }
+    TopicInfo *info = &topic_info[slot];
+    int write_size = snprintf(
+      buffer + message_len, buffer_size - message_len,
+      "%s id %08x local %d peers %d published %llu received %llu\n",
+      // peers only send topic ids, names are known for local subscriptions
+      // and topics published here
+      info->name[0] == '\0' ? "(remote)" : info->name,
+      topic_ids[slot],
+      __builtin_popcount(topic_routes[slot].local_bits),
+      __builtin_popcount(topic_routes[slot].peer_bits),
+      (unsigned long long)info->published, (unsigned long long)info->received
+    );
+    assert(write_size > -1);
+    message_len += (size_t)write_size;
+  }
+  if (message_len >= buffer_size) { message_len = buffer_size == 0 ? 0 : buffer_size - 1; }
+  // without any topic nothing was written, not even the null byte
+  if (buffer_size != 0) { buffer[message_len] = '\0'; }
+  return message_len;
+}
@@ -0,0 +1,72 @@
+
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+
+// Topic based publish/subscribe between peers
+//
+// Local frontends subscribe to named topics through the daemon socket. A
+// daemon tells its connected peers about every topic it has local
+// subscribers for (only when that changes, and once to newly connected peers),
+// so each daemon knows which peers want which topics.
+//
+// The routing index maps hashed topic ids to a bitset of interested peers
+// and a bitset of interested local frontends. Publishing looks up the topic
+// once and only visits the set bits, so the fan-out cost grows with the
+// number of interested peers rather than with the number of peers.
+//
+// Interest travels in single UDP packets, so it is re-announced to every peer
+// each TOPIC_REFRESH_INTERVAL_MS to repair lost subscriptions. A lost
+// unsubscription is repaired by the next message the peer did not want: the
+// receiver answers it with another unsubscription.
+//
+// Messages travel a single hop: a daemon delivers what it receives from a
+// peer to its local subscribers, but does not forward it to other peers.
+
+#define TOPICS_MAX 256 // must be a power of two
+#define TOPIC_PEERS_MAX 32 // one bit per peer in a uint32_t
+#define TOPIC_LOCAL_SUBSCRIBERS_MAX 8 // one bit per frontend in a uint8_t
+#define TOPIC_NAME_MAX 64
+#define TOPIC_REFRESH_INTERVAL_MS 5000
+
+// starts routing topics to (and from) a newly connected peer,
+// and tells it about the topics this daemon has local subscribers for
+void topic_add_peer(int udp_socket, const struct sockaddr_in *peer, FILE *logger);
+
+// re-announces the local subscriptions once they are due
+// (call this at least once per second)
+void topic_tick(int udp_socket, FILE *logger);
+
+// on error, these functions set errno and return -1 (as oposed to 0 for success)
+int topic_subscribe(
+  int udp_socket, const char *topic, size_t topic_len,
+  const struct sockaddr_un *subscriber, FILE *logger
+);
+int topic_unsubscribe(
+  int udp_socket, const char *topic, size_t topic_len,
+  const struct sockaddr_un *subscriber, FILE *logger
+);
+
+// delivers `payload` to the local subscribers and the interested peers
+// (`unix_socket` is the daemon socket the local subscribers are reached through)
+//
+// returns -1 on error (errno is set), or the number of messages the peer and
+// local sockets accepted (which does not mean they arrived)
+int topic_publish(
+  int udp_socket, int unix_socket, const char *topic, size_t topic_len,
+  const char *payload, size_t payload_len, FILE *logger
+);
+
+// handles a packet starting with "topic-" received from a connected peer
+void topic_handle_peer_packet(
+  int udp_socket, int unix_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, FILE *logger
+);
+
+// writes one line per known topic (subscribers and message counts)
+// returns the number of bytes written (excluding the null byte)
+size_t topic_format_stats(char *buffer, size_t buffer_size);
@@ -0,0 +1,986 @@
+
+#define _GNU_SOURCE // accept4
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "stdbool.h"
+#include "assert.h"
+#include "fcntl.h"
+#include "time.h"
+#include "poll.h"
+
+#include "sys/socket.h"
+#include "sys/uio.h"
+
+#include "arpa/inet.h"
+#include "netinet/in.h"
+
+#include "tunnel.h"
+
+// Every tunnel packet is a text message type (like the other peer packets)
+// followed by a binary header, all integers are in network byte order
+//
+//   u32 tunnel_id | u8 sender_is_exposer | u32 stream_id
+//
+// tunnel ids are allocated by the exposing daemon, and stream ids by the
+// listening daemon; `sender_is_exposer` keeps the ids of tunnels exposed in
+// both directions between the same two peers apart
+//
+// message          | direction         | body after the header
+// tunnel-expose:   | exposer -> remote | u8 protocol, u16 listen_port
+// tunnel-exposed:  | remote -> exposer | i32 status (0 or an errno value)
+// tunnel-unexpose: | exposer -> remote |
+// tunnel-open:     | remote -> exposer |
+//                  |                   | (confirmed with an empty tunnel-ack:)
+// tunnel-data:     | both              | u32 seq, u64 send_time_ns, payload
+// tunnel-ack:      | both              | u32 byte_count, u64 echoed send_time_ns (0 for none)
+//                  |                   | (empty ones keep streams with pending data alive)
+// tunnel-fin:      | both              | u32 seq (the sender will not send more data)
+// tunnel-reset:    | both              |
+#define TUNNEL_MSG_EXPOSE   "tunnel-expose:"
+#define TUNNEL_MSG_EXPOSED  "tunnel-exposed:"
+#define TUNNEL_MSG_UNEXPOSE "tunnel-unexpose:"
+#define TUNNEL_MSG_OPEN     "tunnel-open:"
+#define TUNNEL_MSG_DATA     "tunnel-data:"
+#define TUNNEL_MSG_ACK      "tunnel-ack:"
+#define TUNNEL_MSG_FIN      "tunnel-fin:"
+#define TUNNEL_MSG_RESET    "tunnel-reset:"
+
+#define TUNNEL_HEADER_SIZE (4 + 1 + 4)
+// room for the longest message type, the header and the largest message body
+#define TUNNEL_PACKET_HEADER_MAX 64
+// largest payload of a UDP data packet (max udp payload minus our headers)
+#define TUNNEL_UDP_PAYLOAD_MAX (65507 - (sizeof(TUNNEL_MSG_DATA) - 1) - TUNNEL_HEADER_SIZE - 4 - 8)
+
+typedef struct {
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t first_activity_ns;
+  uint64_t last_activity_ns;
+  // round trip of a data packet through both daemons (including the write
+  // to the local socket on the receiving side) - the latency the tunnel adds
+  uint64_t rtt_avg_ns;
+  uint64_t rtt_min_ns;
+  uint64_t rtt_samples;
+  // udp datagrams that were lost or arrived out of order between the daemons
+  uint64_t datagrams_lost;
+} TunnelStats;
+
+typedef struct {
+  bool active;
+  bool is_exposer; // the service lives on this daemon
+  bool established; // the remote acknowledged the expose request
+  uint32_t id;
+  TunnelProtocol protocol;
+  struct sockaddr_in peer;
+  uint16_t service_port;
+  uint16_t listen_port;
+  int listen_fd; // only used on the listening (remote) side, -1 otherwise
+  uint32_t next_stream_id;
+  // the expose request is repeated until the remote acknowledges it
+  uint64_t expose_sent_ns;
+  size_t expose_attempts;
+  TunnelStats stats;
+} Tunnel;
+
+typedef struct {
+  bool active;
+  Tunnel *tunnel;
+  uint32_t id;
+  // the local socket; -1 for udp streams on the listening side which share
+  // the listener socket and are identified by `udp_client`
+  int fd;
+  struct sockaddr_in udp_client;
+  uint32_t send_seq;
+  uint32_t recv_seq;
+  size_t in_flight; // bytes sent to the peer that were not acknowledged yet
+  // data received from the peer that the local socket did not accept yet
+  // (never more than TUNNEL_STREAM_WINDOW bytes)
+  char *pending;
+  size_t pending_len;
+  bool local_eof;
+  bool remote_eof;
+  bool opened; // the exposing daemon connected the stream to its service
+  // last time a packet of this stream arrived from the peer
+  uint64_t last_peer_activity_ns;
+  uint64_t last_keepalive_ns;
+} TunnelStream;
+
+static Tunnel tunnels[TUNNELS_MAX];
+static TunnelStream tunnel_streams[TUNNEL_STREAMS_MAX];
+static uint32_t next_tunnel_id = 1;
+// unacknowledged bytes of all tcp streams together, bounded by what the
+// receive buffer of the peer socket holds
+static size_t total_in_flight = 0;
+static size_t total_in_flight_max = TUNNEL_STREAMS_MAX * TUNNEL_STREAM_WINDOW;
+
+static char tunnel_scratch_buffer[0xffff];
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static size_t put_u8(char *buffer, size_t offset, uint8_t value) {
+  buffer[offset] = (char)value;
+  return offset + 1;
+}
+static size_t put_u16(char *buffer, size_t offset, uint16_t value) {
+  value = htons(value);
+  memcpy(buffer + offset, &value, sizeof(value));
+  return offset + sizeof(value);
+}
+static size_t put_u32(char *buffer, size_t offset, uint32_t value) {
+  value = htonl(value);
+  memcpy(buffer + offset, &value, sizeof(value));
+  return offset + sizeof(value);
+}
+static size_t put_u64(char *buffer, size_t offset, uint64_t value) {
+  offset = put_u32(buffer, offset, (uint32_t)(value >> 32));
+  return put_u32(buffer, offset, (uint32_t)value);
+}
+
+static uint8_t get_u8(const char *buffer, size_t offset) {
+  return (uint8_t)buffer[offset];
+}
+static uint16_t get_u16(const char *buffer, size_t offset) {
+  uint16_t value;
+  memcpy(&value, buffer + offset, sizeof(value));
+  return ntohs(value);
+}
+static uint32_t get_u32(const char *buffer, size_t offset) {
+  uint32_t value;
+  memcpy(&value, buffer + offset, sizeof(value));
+  return ntohl(value);
+}
+static uint64_t get_u64(const char *buffer, size_t offset) {
+  return ((uint64_t)get_u32(buffer, offset) << 32) | get_u32(buffer, offset + 4);
+}
+
+// writes the message type and the common header into `buffer`
+// returns the offset of the message body
+static size_t begin_tunnel_packet(char *buffer, const char *message_type, const Tunnel *tunnel, uint32_t stream_id) {
+  size_t offset = strlen(message_type);
+  memcpy(buffer, message_type, offset);
+  offset = put_u32(buffer, offset, tunnel->id);
+  offset = put_u8(buffer, offset, tunnel->is_exposer);
+  return put_u32(buffer, offset, stream_id);
+}
+
+// returns -1 on error, 0 on success
+static int send_tunnel_packet(int udp_socket, const Tunnel *tunnel, const char *packet, size_t packet_len, int flags) {
+  ssize_t write_size = sendto(
+    udp_socket, packet, packet_len, flags,
+    (const struct sockaddr *)&tunnel->peer, sizeof(tunnel->peer)
+  );
+  if (write_size == -1) { return -1; }
+  assert((size_t)write_size == packet_len);
+  return 0;
+}
+
+static void send_stream_message(int udp_socket, const TunnelStream *stream, const char *message_type, FILE *logger) {
+  char packet[TUNNEL_PACKET_HEADER_MAX];
+  size_t packet_len = begin_tunnel_packet(packet, message_type, stream->tunnel, stream->id);
+  if (strcmp(message_type, TUNNEL_MSG_FIN) == 0) {
+    packet_len = put_u32(packet, packet_len, stream->send_seq);
+  }
+  if (send_tunnel_packet(udp_socket, stream->tunnel, packet, packet_len, 0x0) == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to send %s packet to peer -> %s\n", message_type, strerror(errno)); }
+  }
+}
+
+static void send_stream_ack(int udp_socket, const TunnelStream *stream, uint32_t byte_count, uint64_t echoed_time_ns, FILE *logger) {
+  char packet[TUNNEL_PACKET_HEADER_MAX];
+  size_t packet_len = begin_tunnel_packet(packet, TUNNEL_MSG_ACK, stream->tunnel, stream->id);
+  packet_len = put_u32(packet, packet_len, byte_count);
+  packet_len = put_u64(packet, packet_len, echoed_time_ns);
+  if (send_tunnel_packet(udp_socket, stream->tunnel, packet, packet_len, 0x0) == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to send tunnel ack to peer -> %s\n", strerror(errno)); }
+  }
+}
+
+static void record_activity(TunnelStats *stats) {
+  uint64_t now = monotonic_ns();
+  if (stats->first_activity_ns == 0) { stats->first_activity_ns = now; }
+  stats->last_activity_ns = now;
+}
+
+static void record_rtt_sample(TunnelStats *stats, uint64_t rtt_ns) {
+  if (stats->rtt_samples == 0) {
+    stats->rtt_avg_ns = rtt_ns;
+    stats->rtt_min_ns = rtt_ns;
+  }else {
+    // exponentially weighted moving average (alpha = 1/8, like tcp srtt)
+    stats->rtt_avg_ns = (stats->rtt_avg_ns * 7 + rtt_ns) / 8;
+    if (rtt_ns < stats->rtt_min_ns) { stats->rtt_min_ns = rtt_ns; }
+  }
+  stats->rtt_samples += 1;
+}
+
+static Tunnel *find_tunnel(const struct sockaddr_in *peer, uint32_t id, bool is_exposer) {
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    Tunnel *tunnel = &tunnels[i];
+    if (
+      tunnel->active && tunnel->id == id && tunnel->is_exposer == is_exposer
+      && tunnel->peer.sin_addr.s_addr == peer->sin_addr.s_addr
+      && tunnel->peer.sin_port == peer->sin_port
+    ) { return tunnel; }
+  }
+  return NULL;
+}
+
+static Tunnel *alloc_tunnel() {
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    if (!tunnels[i].active) {
+      tunnels[i] = (Tunnel){ .active = true, .listen_fd = -1 };
+      return &tunnels[i];
+    }
+  }
+  return NULL;
+}
+
+static TunnelStream *find_stream(const Tunnel *tunnel, uint32_t id) {
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX; i += 1) {
+    TunnelStream *stream = &tunnel_streams[i];
+    if (stream->active && stream->tunnel == tunnel && stream->id == id) { return stream; }
+  }
+  return NULL;
+}
+
+static TunnelStream *find_udp_client_stream(const Tunnel *tunnel, const struct sockaddr_in *client) {
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX; i += 1) {
+    TunnelStream *stream = &tunnel_streams[i];
+    if (
+      stream->active && stream->tunnel == tunnel
+      && stream->udp_client.sin_addr.s_addr == client->sin_addr.s_addr
+      && stream->udp_client.sin_port == client->sin_port
+    ) { return stream; }
+  }
+  return NULL;
+}
+
+static void free_stream(TunnelStream *stream) {
+  assert(stream->active);
+  if (stream->fd != -1) { close(stream->fd); }
+  free(stream->pending);
+  total_in_flight -= stream->in_flight;
+  *stream = (TunnelStream){ 0 };
+}
+
+static void reset_stream(int udp_socket, TunnelStream *stream, FILE *logger) {
+  send_stream_message(udp_socket, stream, TUNNEL_MSG_RESET, logger);
+  free_stream(stream);
+}
+
+// takes ownership of `fd`
+// when every slot is taken, the least recently active udp stream is reset to
+// make room, as udp clients have no way of telling that they are done
+//
+// returns NULL when the stream limit has been reached
+static TunnelStream *alloc_stream(int udp_socket, Tunnel *tunnel, uint32_t id, int fd, FILE *logger) {
+  TunnelStream *free_slot = NULL;
+  TunnelStream *oldest_udp_stream = NULL;
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX && free_slot == NULL; i += 1) {
+    TunnelStream *stream = &tunnel_streams[i];
+    if (!stream->active) {
+      free_slot = stream;
+    }else if (
+      stream->tunnel->protocol == TUNNEL_PROTO_UDP
+      && (oldest_udp_stream == NULL || stream->last_peer_activity_ns < oldest_udp_stream->last_peer_activity_ns)
+    ) {
+      oldest_udp_stream = stream;
+    }
+  }
+  if (free_slot == NULL && oldest_udp_stream != NULL) {
+    if (logger != NULL) { fprintf(logger, "WARN: tunnel stream limit reached, evicting the least recently active udp stream\n"); }
+    reset_stream(udp_socket, oldest_udp_stream, logger);
+    free_slot = oldest_udp_stream;
+  }
+  if (free_slot == NULL) { return NULL; }
+
+  *free_slot = (TunnelStream){
+    .active = true,
+    .tunnel = tunnel,
+    .id = id,
+    .fd = fd,
+    .last_peer_activity_ns = monotonic_ns(),
+  };
+  return free_slot;
+}
+
+static void free_tunnel(Tunnel *tunnel) {
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX; i += 1) {
+    if (tunnel_streams[i].active && tunnel_streams[i].tunnel == tunnel) {
+      free_stream(&tunnel_streams[i]);
+    }
+  }
+  if (tunnel->listen_fd != -1) { close(tunnel->listen_fd); }
+  *tunnel = (Tunnel){ 0 };
+}
+
+// frees the stream once both directions are finished, and forwards the
+// peer's end of stream to the local socket once all its data was written
+static void maybe_finish_stream(TunnelStream *stream) {
+  if (!stream->remote_eof || stream->pending_len != 0) { return; }
+  if (stream->local_eof) {
+    free_stream(stream);
+  }else if (stream->fd != -1) {
+    shutdown(stream->fd, SHUT_WR);
+  }
+}
+
+// the kernel gathers the header and the payload into one datagram, so the
+// payload is only copied once on its way from the local socket to the peer
+//
+// NOTE splicing the local socket into the datagram would avoid that copy, but
+// it needs MSG_MORE corking on the shared (unconnected) udp socket, and corked
+// datagrams built from spliced pages fail their checksum on the receiving end
+//
+// returns -1 on error, 0 on success
+static int send_stream_payload(int udp_socket, TunnelStream *stream, const char *payload, size_t payload_len, FILE *logger) {
+  Tunnel *tunnel = stream->tunnel;
+  char header[TUNNEL_PACKET_HEADER_MAX];
+  size_t header_len = begin_tunnel_packet(header, TUNNEL_MSG_DATA, tunnel, stream->id);
+  header_len = put_u32(header, header_len, stream->send_seq);
+  header_len = put_u64(header, header_len, monotonic_ns());
+
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = header_len },
+    { .iov_base = (void *)payload, .iov_len = payload_len },
+  };
+  struct msghdr message = {
+    .msg_name = &tunnel->peer,
+    .msg_namelen = sizeof(tunnel->peer),
+    .msg_iov = iov,
+    .msg_iovlen = 2,
+  };
+  ssize_t write_size = sendmsg(udp_socket, &message, 0x0);
+  if (write_size == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to send tunnel data to peer -> %s\n", strerror(errno)); }
+    return -1;
+  }
+  stream->send_seq += 1;
+  tunnel->stats.bytes_sent += payload_len;
+  record_activity(&tunnel->stats);
+  return 0;
+}
+
+// returns how many bytes the tcp stream may send to the peer right now
+//
+// every datagram costs the receiver roughly a kilobyte of receive buffer on
+// top of its payload, so sending resumes only once a quarter chunk of window
+// is free again, instead of with a tiny datagram for every tiny ack
+static size_t stream_send_budget(const TunnelStream *stream) {
+  size_t budget = TUNNEL_STREAM_WINDOW - stream->in_flight;
+  if (budget > total_in_flight_max - total_in_flight) { budget = total_in_flight_max - total_in_flight; }
+  if (budget > TUNNEL_CHUNK_SIZE) { budget = TUNNEL_CHUNK_SIZE; }
+  return budget < TUNNEL_CHUNK_SIZE / 4 ? 0 : budget;
+}
+
+// forwards data that is readable on the local tcp socket to the peer
+static void forward_local_tcp(int udp_socket, TunnelStream *stream, FILE *logger) {
+  size_t budget = stream_send_budget(stream);
+  if (budget == 0) { return; }
+
+  ssize_t read_size = recv(stream->fd, tunnel_scratch_buffer, budget, MSG_DONTWAIT);
+  if (read_size == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+    if (logger != NULL) { fprintf(logger, "Failed to read from tunnel stream -> %s\n", strerror(errno)); }
+    reset_stream(udp_socket, stream, logger);
+    return;
+  }
+  if (read_size == 0) {
+    stream->local_eof = true;
+    send_stream_message(udp_socket, stream, TUNNEL_MSG_FIN, logger);
+    maybe_finish_stream(stream);
+    return;
+  }
+
+  if (send_stream_payload(udp_socket, stream, tunnel_scratch_buffer, (size_t)read_size, logger) == -1) {
+    reset_stream(udp_socket, stream, logger);
+    return;
+  }
+  stream->in_flight += (size_t)read_size;
+  total_in_flight += (size_t)read_size;
+}
+
+// forwards a datagram that is readable on the local (exposer side) udp socket
+static void forward_local_udp(int udp_socket, TunnelStream *stream, FILE *logger) {
+  ssize_t read_size = recv(stream->fd, tunnel_scratch_buffer, TUNNEL_UDP_PAYLOAD_MAX, MSG_DONTWAIT);
+  if (read_size == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+    // e.g. ECONNREFUSED from a previous datagram when the service is down
+    if (logger != NULL) { fprintf(logger, "Failed to read from tunnel stream -> %s\n", strerror(errno)); }
+    return;
+  }
+  send_stream_payload(udp_socket, stream, tunnel_scratch_buffer, (size_t)read_size, logger);
+}
+
+// accepts a new client on the listening side and opens a stream for it
+static void accept_tunnel_client(int udp_socket, Tunnel *tunnel, FILE *logger) {
+  if (tunnel->protocol == TUNNEL_PROTO_TCP) {
+    int client = accept4(tunnel->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && logger != NULL) {
+        fprintf(logger, "Failed to accept tunnel client -> %s\n", strerror(errno));
+      }
+      return;
+    }
+    TunnelStream *stream = alloc_stream(udp_socket, tunnel, tunnel->next_stream_id, client, logger);
+    if (stream == NULL) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream limit reached, dropping client\n"); }
+      close(client);
+      return;
+    }
+    tunnel->next_stream_id += 1;
+    send_stream_message(udp_socket, stream, TUNNEL_MSG_OPEN, logger);
+    return;
+  }
+
+  struct sockaddr_in client = { .sin_family = AF_INET };
+  socklen_t client_len = sizeof(client);
+  ssize_t read_size = recvfrom(
+    tunnel->listen_fd, tunnel_scratch_buffer, TUNNEL_UDP_PAYLOAD_MAX, MSG_DONTWAIT,
+    (struct sockaddr *)&client, &client_len
+  );
+  if (read_size == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && logger != NULL) {
+      fprintf(logger, "Failed to read from tunnel listener -> %s\n", strerror(errno));
+    }
+    return;
+  }
+  TunnelStream *stream = find_udp_client_stream(tunnel, &client);
+  if (stream == NULL) {
+    stream = alloc_stream(udp_socket, tunnel, tunnel->next_stream_id, -1, logger);
+    if (stream == NULL) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream limit reached, dropping datagram\n"); }
+      return;
+    }
+    tunnel->next_stream_id += 1;
+    stream->udp_client = client;
+    send_stream_message(udp_socket, stream, TUNNEL_MSG_OPEN, logger);
+  }
+  send_stream_payload(udp_socket, stream, tunnel_scratch_buffer, (size_t)read_size, logger);
+}
+
+// writes as much of the pending data to the local socket as it accepts
+static void flush_pending(int udp_socket, TunnelStream *stream, FILE *logger) {
+  if (stream->pending_len == 0) { return; }
+  ssize_t write_size = send(stream->fd, stream->pending, stream->pending_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (write_size == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+    if (logger != NULL) { fprintf(logger, "Failed to write to tunnel stream -> %s\n", strerror(errno)); }
+    reset_stream(udp_socket, stream, logger);
+    return;
+  }
+  memmove(stream->pending, stream->pending + write_size, stream->pending_len - (size_t)write_size);
+  stream->pending_len -= (size_t)write_size;
+  // this data waited on the local socket, so it makes no rtt sample
+  send_stream_ack(udp_socket, stream, (uint32_t)write_size, 0, logger);
+  maybe_finish_stream(stream);
+}
+
+static void handle_stream_data(
+  int udp_socket, TunnelStream *stream, uint32_t seq, uint64_t send_time_ns,
+  const char *payload, size_t payload_len, FILE *logger
+) {
+  Tunnel *tunnel = stream->tunnel;
+  if (tunnel->protocol == TUNNEL_PROTO_UDP) {
+    // udp tolerates loss, so the gap is only counted, and late datagrams are
+    // dropped to keep the order the service sees
+    if ((int32_t)(seq - stream->recv_seq) < 0) {
+      tunnel->stats.datagrams_lost += 1;
+      return;
+    }
+    tunnel->stats.datagrams_lost += seq - stream->recv_seq;
+    stream->recv_seq = seq;
+  }else if (seq != stream->recv_seq || stream->remote_eof) {
+    if (logger != NULL) { fprintf(logger, "WARN: tunnel stream lost a packet, resetting it\n"); }
+    reset_stream(udp_socket, stream, logger);
+    return;
+  }
+  stream->recv_seq += 1;
+  tunnel->stats.bytes_received += payload_len;
+  record_activity(&tunnel->stats);
+
+  if (tunnel->protocol == TUNNEL_PROTO_UDP) {
+    ssize_t write_size;
+    if (stream->fd == -1) {
+      write_size = sendto(
+        tunnel->listen_fd, payload, payload_len, MSG_DONTWAIT,
+        (struct sockaddr *)&stream->udp_client, sizeof(stream->udp_client)
+      );
+    }else {
+      write_size = send(stream->fd, payload, payload_len, MSG_DONTWAIT);
+    }
+    if (write_size == -1 && logger != NULL) {
+      fprintf(logger, "Failed to forward tunnel datagram -> %s\n", strerror(errno));
+    }
+    send_stream_ack(udp_socket, stream, (uint32_t)payload_len, send_time_ns, logger);
+    return;
+  }
+
+  size_t written = 0;
+  if (stream->pending_len == 0) {
+    ssize_t write_size = send(stream->fd, payload, payload_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (write_size == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      if (logger != NULL) { fprintf(logger, "Failed to write to tunnel stream -> %s\n", strerror(errno)); }
+      reset_stream(udp_socket, stream, logger);
+      return;
+    }
+    if (write_size > 0) { written = (size_t)write_size; }
+  }
+
+  size_t remaining = payload_len - written;
+  if (remaining > 0) {
+    // the sender never has more than a window of data in flight, so a
+    // window sized buffer can not overflow unless the peer misbehaves
+    if (stream->pending == NULL) { stream->pending = malloc(TUNNEL_STREAM_WINDOW); }
+    if (stream->pending == NULL || stream->pending_len + remaining > TUNNEL_STREAM_WINDOW) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream exceeded its window, resetting it\n"); }
+      reset_stream(udp_socket, stream, logger);
+      return;
+    }
+    memcpy(stream->pending + stream->pending_len, payload + written, remaining);
+    stream->pending_len += remaining;
+  }
+  if (written > 0) {
+    send_stream_ack(udp_socket, stream, (uint32_t)written, send_time_ns, logger);
+  }
+}
+
+// connects a new stream to the local service (exposer side)
+static void open_service_stream(int udp_socket, Tunnel *tunnel, uint32_t stream_id, FILE *logger) {
+  if (find_stream(tunnel, stream_id) != NULL) { return; }
+
+  int service = socket(
+    PF_INET, tunnel->protocol == TUNNEL_PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0
+  );
+  if (service == -1) {
+    if (logger != NULL) { fprintf(logger, "Failed to create tunnel service socket -> %s\n", strerror(errno)); }
+  }
+  struct sockaddr_in service_address = {
+    .sin_family = AF_INET,
+    .sin_port = htons(tunnel->service_port),
+    .sin_addr = { .s_addr = htonl(INADDR_LOOPBACK) },
+  };
+  // the service is on loopback, so a blocking connect returns immediately
+  if (
+    service != -1
+    && connect(service, (struct sockaddr *)&service_address, sizeof(service_address)) == -1
+  ) {
+    if (logger != NULL) { fprintf(logger, "Failed to connect to tunneled service on port %u -> %s\n", tunnel->service_port, strerror(errno)); }
+    close(service);
+    service = -1;
+  }
+  if (service != -1) {
+    fcntl(service, F_SETFL, fcntl(service, F_GETFL) | O_NONBLOCK);
+  }
+
+  TunnelStream *stream = service == -1 ? NULL : alloc_stream(udp_socket, tunnel, stream_id, service, logger);
+  if (stream == NULL) {
+    if (service != -1) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream limit reached, refusing stream\n"); }
+      close(service);
+    }
+    TunnelStream refused = { .tunnel = tunnel, .id = stream_id };
+    send_stream_message(udp_socket, &refused, TUNNEL_MSG_RESET, logger);
+    return;
+  }
+  stream->opened = true;
+  send_stream_ack(udp_socket, stream, 0, 0, logger);
+}
+
+// opens the listener for a tunnel exposed by a peer (remote side)
+// returns -1 on error (errno is set), 0 on success
+static int open_tunnel_listener(Tunnel *tunnel) {
+  bool is_tcp = tunnel->protocol == TUNNEL_PROTO_TCP;
+  int listener = socket(PF_INET, (is_tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1) { return -1; }
+
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in bind_address = {
+    .sin_family = AF_INET,
+    .sin_port = htons(tunnel->listen_port),
+    .sin_addr = { .s_addr = htonl(INADDR_ANY) },
+  };
+  if (
+    bind(listener, (struct sockaddr *)&bind_address, sizeof(bind_address)) == -1
+    || (is_tcp && listen(listener, 16) == -1)
+  ) {
+    int bind_errno = errno;
+    close(listener);
+    errno = bind_errno;
+    return -1;
+  }
+  tunnel->listen_fd = listener;
+  return 0;
+}
+
+// returns -1 on error (errno is set), 0 on success
+static int send_expose_request(int udp_socket, Tunnel *tunnel) {
+  char packet[TUNNEL_PACKET_HEADER_MAX];
+  size_t packet_len = begin_tunnel_packet(packet, TUNNEL_MSG_EXPOSE, tunnel, 0);
+  packet_len = put_u8(packet, packet_len, (uint8_t)tunnel->protocol);
+  packet_len = put_u16(packet, packet_len, tunnel->listen_port);
+  tunnel->expose_sent_ns = monotonic_ns();
+  tunnel->expose_attempts += 1;
+  return send_tunnel_packet(udp_socket, tunnel, packet, packet_len, 0x0);
+}
+
+void tunnel_set_receive_buffer(size_t receive_buffer_size) {
+  total_in_flight_max = receive_buffer_size;
+  if (total_in_flight_max > TUNNEL_STREAMS_MAX * TUNNEL_STREAM_WINDOW) {
+    total_in_flight_max = TUNNEL_STREAMS_MAX * TUNNEL_STREAM_WINDOW;
+  }
+  // one chunk at a time still works, only slower
+  if (total_in_flight_max < TUNNEL_CHUNK_SIZE) { total_in_flight_max = TUNNEL_CHUNK_SIZE; }
+}
+
+int tunnel_expose(
+  int udp_socket, const struct sockaddr_in *peer, TunnelProtocol protocol,
+  uint16_t service_port, uint16_t listen_port, FILE *logger
+) {
+  Tunnel *tunnel = alloc_tunnel();
+  if (tunnel == NULL) {
+    errno = ENOSPC;
+    return -1;
+  }
+  tunnel->is_exposer = true;
+  tunnel->id = next_tunnel_id;
+  tunnel->protocol = protocol;
+  tunnel->peer = *peer;
+  tunnel->service_port = service_port;
+  tunnel->listen_port = listen_port;
+  next_tunnel_id += 1;
+
+  if (send_expose_request(udp_socket, tunnel) == -1) {
+    int send_errno = errno;
+    if (logger != NULL) { fprintf(logger, "Failed to send tunnel expose request to peer -> %s\n", strerror(errno)); }
+    free_tunnel(tunnel);
+    errno = send_errno;
+    return -1;
+  }
+  return (int)tunnel->id;
+}
+
+static void send_unexpose(int udp_socket, const Tunnel *tunnel) {
+  char packet[TUNNEL_PACKET_HEADER_MAX];
+  size_t packet_len = begin_tunnel_packet(packet, TUNNEL_MSG_UNEXPOSE, tunnel, 0);
+  send_tunnel_packet(udp_socket, tunnel, packet, packet_len, 0x0);
+}
+
+int tunnel_unexpose(int udp_socket, uint32_t id) {
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    Tunnel *tunnel = &tunnels[i];
+    if (!tunnel->active || !tunnel->is_exposer || tunnel->id != id) { continue; }
+    // the peer closes its side of the streams with the tunnel
+    send_unexpose(udp_socket, tunnel);
+    free_tunnel(tunnel);
+    return 0;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+// handles the messages that set up or tear down a whole tunnel
+static void handle_tunnel_control(
+  int udp_socket, const char *message_type, const char *body, size_t body_len,
+  uint32_t tunnel_id, const struct sockaddr_in *peer, FILE *logger
+) {
+  if (strcmp(message_type, TUNNEL_MSG_EXPOSE) == 0) {
+    if (body_len < 3) { return; }
+    int32_t status = 0;
+    // a repeated request (e.g. the reply got lost) is acknowledged again
+    if (find_tunnel(peer, tunnel_id, false) == NULL) {
+      Tunnel *tunnel = alloc_tunnel();
+      if (tunnel == NULL) {
+        status = ENOSPC;
+      }else {
+        tunnel->id = tunnel_id;
+        tunnel->peer = *peer;
+        tunnel->protocol = get_u8(body, 0) == TUNNEL_PROTO_UDP ? TUNNEL_PROTO_UDP : TUNNEL_PROTO_TCP;
+        tunnel->listen_port = get_u16(body, 1);
+        tunnel->next_stream_id = 1;
+        tunnel->established = true;
+        if (open_tunnel_listener(tunnel) == -1) {
+          status = errno;
+          if (logger != NULL) { fprintf(logger, "Failed to open tunnel listener on port %u -> %s\n", tunnel->listen_port, strerror(errno)); }
+          free_tunnel(tunnel);
+        }else {
+          fprintf(stdout, "INFO: peer exposed a %s service on port %u\n", tunnel->protocol == TUNNEL_PROTO_TCP ? "tcp" : "udp", tunnel->listen_port);
+        }
+      }
+    }
+    // only the id and direction of the tunnel go into the reply header
+    Tunnel reply_tunnel = { .id = tunnel_id, .peer = *peer };
+    char packet[TUNNEL_PACKET_HEADER_MAX];
+    size_t packet_len = begin_tunnel_packet(packet, TUNNEL_MSG_EXPOSED, &reply_tunnel, 0);
+    packet_len = put_u32(packet, packet_len, (uint32_t)status);
+    if (send_tunnel_packet(udp_socket, &reply_tunnel, packet, packet_len, 0x0) == -1) {
+      if (logger != NULL) { fprintf(logger, "Failed to acknowledge tunnel expose request -> %s\n", strerror(errno)); }
+    }
+  }else if (strcmp(message_type, TUNNEL_MSG_EXPOSED) == 0) {
+    Tunnel *tunnel = find_tunnel(peer, tunnel_id, true);
+    if (tunnel == NULL || body_len < 4) { return; }
+    int32_t status = (int32_t)get_u32(body, 0);
+    if (status != 0) {
+      if (logger != NULL) { fprintf(logger, "Peer refused to expose tunnel %u -> %s\n", tunnel_id, strerror(status)); }
+      free_tunnel(tunnel);
+      return;
+    }
+    tunnel->established = true;
+    fprintf(stdout, "INFO: tunnel %u established, peer listens on port %u\n", tunnel_id, tunnel->listen_port);
+  }else if (strcmp(message_type, TUNNEL_MSG_UNEXPOSE) == 0) {
+    Tunnel *tunnel = find_tunnel(peer, tunnel_id, false);
+    if (tunnel == NULL) { return; }
+    fprintf(stdout, "INFO: peer closed the tunnel on port %u\n", tunnel->listen_port);
+    free_tunnel(tunnel);
+  }
+}
+
+void tunnel_handle_peer_packet(
+  int udp_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, FILE *logger
+) {
+  static const char *message_types[] = {
+    TUNNEL_MSG_EXPOSE, TUNNEL_MSG_EXPOSED, TUNNEL_MSG_UNEXPOSE, TUNNEL_MSG_OPEN,
+    TUNNEL_MSG_DATA, TUNNEL_MSG_ACK, TUNNEL_MSG_FIN, TUNNEL_MSG_RESET,
+  };
+  const char *message_type = NULL;
+  size_t offset = 0;
+  for (size_t i = 0; i < sizeof(message_types) / sizeof(message_types[0]); i += 1) {
+    size_t type_len = strlen(message_types[i]);
+    if (packet_len >= type_len && strncmp(message_types[i], packet, type_len) == 0) {
+      message_type = message_types[i];
+      offset = type_len;
+      break;
+    }
+  }
+  if (message_type == NULL || packet_len < offset + TUNNEL_HEADER_SIZE) {
+    if (logger != NULL) { fprintf(logger, "WARN: invalid tunnel packet from peer\n"); }
+    return;
+  }
+  uint32_t tunnel_id = get_u32(packet, offset);
+  bool sender_is_exposer = get_u8(packet, offset + 4) != 0;
+  uint32_t stream_id = get_u32(packet, offset + 5);
+  const char *body = packet + offset + TUNNEL_HEADER_SIZE;
+  size_t body_len = packet_len - offset - TUNNEL_HEADER_SIZE;
+
+  if (
+    strcmp(message_type, TUNNEL_MSG_EXPOSE) == 0
+    || strcmp(message_type, TUNNEL_MSG_EXPOSED) == 0
+    || strcmp(message_type, TUNNEL_MSG_UNEXPOSE) == 0
+  ) {
+    handle_tunnel_control(udp_socket, message_type, body, body_len, tunnel_id, peer, logger);
+    return;
+  }
+
+  Tunnel *tunnel = find_tunnel(peer, tunnel_id, !sender_is_exposer);
+  if (tunnel == NULL) { return; }
+
+  if (strcmp(message_type, TUNNEL_MSG_OPEN) == 0) {
+    if (tunnel->is_exposer) { open_service_stream(udp_socket, tunnel, stream_id, logger); }
+    return;
+  }
+
+  TunnelStream *stream = find_stream(tunnel, stream_id);
+  if (stream == NULL) { return; } // e.g. already reset, or late acks
+  stream->last_peer_activity_ns = monotonic_ns();
+  stream->opened = true;
+
+  if (strcmp(message_type, TUNNEL_MSG_DATA) == 0) {
+    if (body_len < 12) { return; }
+    handle_stream_data(
+      udp_socket, stream, get_u32(body, 0), get_u64(body, 4),
+      body + 12, body_len - 12, logger
+    );
+  }else if (strcmp(message_type, TUNNEL_MSG_ACK) == 0) {
+    if (body_len < 12) { return; }
+    uint32_t byte_count = get_u32(body, 0);
+    uint64_t echoed_time_ns = get_u64(body, 4);
+    if (tunnel->protocol == TUNNEL_PROTO_TCP) {
+      size_t acknowledged = byte_count < stream->in_flight ? byte_count : stream->in_flight;
+      stream->in_flight -= acknowledged;
+      total_in_flight -= acknowledged;
+    }
+    if (echoed_time_ns != 0) {
+      record_rtt_sample(&tunnel->stats, monotonic_ns() - echoed_time_ns);
+    }
+  }else if (strcmp(message_type, TUNNEL_MSG_FIN) == 0) {
+    if (body_len < 4) { return; }
+    if (get_u32(body, 0) != stream->recv_seq) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream lost a packet, resetting it\n"); }
+      reset_stream(udp_socket, stream, logger);
+      return;
+    }
+    stream->remote_eof = true;
+    maybe_finish_stream(stream);
+  }else if (strcmp(message_type, TUNNEL_MSG_RESET) == 0) {
+    free_stream(stream);
+  }
+}
+
+size_t tunnel_fill_pollfds(struct pollfd *fds, size_t max_count) {
+  size_t count = 0;
+  for (size_t i = 0; i < TUNNELS_MAX && count < max_count; i += 1) {
+    if (tunnels[i].active && tunnels[i].listen_fd != -1) {
+      fds[count] = (struct pollfd){ .fd = tunnels[i].listen_fd, .events = POLLIN };
+      count += 1;
+    }
+  }
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX && count < max_count; i += 1) {
+    TunnelStream *stream = &tunnel_streams[i];
+    if (!stream->active || stream->fd == -1) { continue; }
+    short events = 0;
+    if (
+      !stream->local_eof
+      && (stream->tunnel->protocol == TUNNEL_PROTO_UDP || stream_send_budget(stream) != 0)
+    ) { events |= POLLIN; }
+    if (stream->pending_len != 0) { events |= POLLOUT; }
+    // streams waiting for acks are left out, otherwise a hung up socket
+    // would wake poll continuously
+    if (events == 0) { continue; }
+    fds[count] = (struct pollfd){ .fd = stream->fd, .events = events };
+    count += 1;
+  }
+  return count;
+}
+
+void tunnel_handle_pollfds(int udp_socket, struct pollfd *fds, size_t count, FILE *logger) {
+  for (size_t i = 0; i < count; i += 1) {
+    if (fds[i].revents == 0) { continue; }
+    int fd = fds[i].fd;
+
+    for (size_t t = 0; t < TUNNELS_MAX; t += 1) {
+      if (tunnels[t].active && tunnels[t].listen_fd == fd) {
+        accept_tunnel_client(udp_socket, &tunnels[t], logger);
+      }
+    }
+    for (size_t s = 0; s < TUNNEL_STREAMS_MAX; s += 1) {
+      TunnelStream *stream = &tunnel_streams[s];
+      if (!stream->active || stream->fd != fd) { continue; }
+      if (fds[i].revents & POLLOUT) {
+        flush_pending(udp_socket, stream, logger);
+      }
+      if (!stream->active || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) { continue; }
+      if (stream->local_eof) { continue; }
+      if (stream->tunnel->protocol == TUNNEL_PROTO_TCP) {
+        forward_local_tcp(udp_socket, stream, logger);
+      }else {
+        forward_local_udp(udp_socket, stream, logger);
+      }
+    }
+  }
+}
+
+void tunnel_tick(int udp_socket, FILE *logger) {
+  uint64_t now = monotonic_ns();
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    Tunnel *tunnel = &tunnels[i];
+    if (!tunnel->active || tunnel->established) { continue; }
+    if (now - tunnel->expose_sent_ns < (uint64_t)TUNNEL_EXPOSE_RETRY_MS * 1000000) { continue; }
+    if (tunnel->expose_attempts < TUNNEL_EXPOSE_ATTEMPTS_MAX) {
+      // the remote acknowledges a repeated request again
+      send_expose_request(udp_socket, tunnel);
+      continue;
+    }
+    if (logger != NULL) { fprintf(logger, "WARN: peer did not answer the request for tunnel %u, giving up\n", tunnel->id); }
+    // in case only the answers got lost
+    send_unexpose(udp_socket, tunnel);
+    free_tunnel(tunnel);
+  }
+
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX; i += 1) {
+    TunnelStream *stream = &tunnel_streams[i];
+    if (!stream->active) { continue; }
+    uint64_t idle_ns = now - stream->last_peer_activity_ns;
+
+    if (stream->tunnel->protocol == TUNNEL_PROTO_UDP) {
+      // every forwarded datagram is acknowledged, so this covers both directions
+      if (idle_ns > (uint64_t)TUNNEL_UDP_IDLE_TIMEOUT_MS * 1000000) {
+        reset_stream(udp_socket, stream, logger);
+      }
+      continue;
+    }
+    // data waiting for the local socket is not acknowledged yet, so the
+    // sender is told that this stream is only backed up and not lost
+    if (
+      stream->pending_len != 0
+      && now - stream->last_keepalive_ns > (uint64_t)TUNNEL_KEEPALIVE_INTERVAL_MS * 1000000
+    ) {
+      send_stream_ack(udp_socket, stream, 0, 0, logger);
+      stream->last_keepalive_ns = now;
+    }
+    // an idle tcp stream is fine, but one that waits on the peer (for the
+    // open confirmation, acks or the end of stream) stalled when the packet
+    // it waits for got lost
+    bool waits_on_peer = !stream->opened || stream->in_flight > 0 || stream->local_eof;
+    if (waits_on_peer && idle_ns > (uint64_t)TUNNEL_STREAM_STALL_TIMEOUT_MS * 1000000) {
+      if (logger != NULL) { fprintf(logger, "WARN: tunnel stream stalled, resetting it\n"); }
+      reset_stream(udp_socket, stream, logger);
+    }
+  }
+}
+
+size_t tunnel_format_stats(char *buffer, size_t buffer_size) {
+  size_t message_len = 0;
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    Tunnel *tunnel = &tunnels[i];
+    if (!tunnel->active) { continue; }
+
+    size_t stream_count = 0;
+    for (size_t s = 0; s < TUNNEL_STREAMS_MAX; s += 1) {
+      if (tunnel_streams[s].active && tunnel_streams[s].tunnel == tunnel) { stream_count += 1; }
+    }
+    TunnelStats *stats = &tunnel->stats;
+    double elapsed_s = (double)(stats->last_activity_ns - stats->first_activity_ns) / 1e9;
+    double throughput = elapsed_s > 0
+      ? (double)(stats->bytes_sent + stats->bytes_received) / elapsed_s / (1024 * 1024)
+      : 0;
+
+    if (message_len >= buffer_size) { break; }
+    int write_size = snprintf(
+      buffer + message_len, buffer_size - message_len,
+      "%s %u %s %s %u.%u.%u.%u:%u port %u%s streams %zu tx %llu rx %llu "
+      "throughput %.2f MiB/s rtt avg %.1f us min %.1f us lost %llu\n",
+      tunnel->is_exposer ? "exposed" : "listening", tunnel->id,
+      tunnel->protocol == TUNNEL_PROTO_TCP ? "tcp" : "udp",
+      tunnel->is_exposer ? "on" : "for",
+      (uint8_t)(tunnel->peer.sin_addr.s_addr),
+      (uint8_t)(tunnel->peer.sin_addr.s_addr >> 1 * 8),
+      (uint8_t)(tunnel->peer.sin_addr.s_addr >> 2 * 8),
+      (uint8_t)(tunnel->peer.sin_addr.s_addr >> 3 * 8),
+      tunnel->peer.sin_port,
+      tunnel->is_exposer ? tunnel->service_port : tunnel->listen_port,
+      tunnel->established ? "" : " (pending)",
+      stream_count,
+      (unsigned long long)stats->bytes_sent, (unsigned long long)stats->bytes_received,
+      throughput, (double)stats->rtt_avg_ns / 1e3, (double)stats->rtt_min_ns / 1e3,
+      (unsigned long long)stats->datagrams_lost
+    );
+    assert(write_size > -1);
+    message_len += (size_t)write_size;
+  }
+  if (message_len >= buffer_size) { message_len = buffer_size == 0 ? 0 : buffer_size - 1; }
+  // without any tunnel nothing was written, not even the null byte
+  if (buffer_size != 0) { buffer[message_len] = '\0'; }
+  return message_len;
+}
+
+void tunnel_shutdown(int udp_socket) {
+  for (size_t i = 0; i < TUNNEL_STREAMS_MAX; i += 1) {
+    if (tunnel_streams[i].active) { reset_stream(udp_socket, &tunnel_streams[i], NULL); }
+  }
+  for (size_t i = 0; i < TUNNELS_MAX; i += 1) {
+    Tunnel *tunnel = &tunnels[i];
+    if (!tunnel->active) { continue; }
+    if (tunnel->is_exposer) { send_unexpose(udp_socket, tunnel); }
+    free_tunnel(tunnel);
+  }
+}
@@ -0,0 +1,96 @@
+
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "poll.h"
+
+#include "netinet/in.h"
+
+// Userspace port forwarding between peers
+//
+// A daemon "exposes" one of its local services (a TCP or UDP port on the
+// loopback interface) on a connected peer. The peer opens a listener on the
+// requested port, and every client of that listener becomes a stream that is
+// multiplexed over the regular peer UDP socket. The exposing daemon connects
+// each stream to the local service.
+//
+// TCP streams are flow controlled: at most TUNNEL_STREAM_WINDOW bytes may be
+// unacknowledged, and the receiving daemon only acknowledges bytes once they
+// have been written to its local socket, so the per-stream buffering on both
+// sides is bounded by the window. All streams together keep at most as much
+// data in flight as the receive buffer of the peer socket holds (see
+// tunnel_set_receive_buffer()), as a datagram dropped there resets its stream.
+//
+// Lost or reordered datagrams are not retransmitted, a sequence gap resets a
+// TCP stream instead. This is fine on loopback/lan, but not across the internet.
+// UDP streams just count the lost datagrams.
+//
+// UDP clients never say that they are done, so a UDP stream is closed after
+// TUNNEL_UDP_IDLE_TIMEOUT_MS without traffic (or earlier, when its slot is
+// needed for a new stream). A TCP stream that waits on the peer (to confirm
+// the stream, acknowledge data or end the stream) is reset after
+// TUNNEL_STREAM_STALL_TIMEOUT_MS without an answer, so a lost control packet
+// does not hold on to its slot forever. A receiver holding data its local
+// socket did not accept yet sends keepalives meanwhile, so a backed up stream
+// does not count as stalled. This also ends half closed streams
+// whose other direction stays silent for that long.
+
+#define TUNNELS_MAX 8
+#define TUNNEL_STREAMS_MAX 32
+// maximum payload carried by a single TCP data packet
+#define TUNNEL_CHUNK_SIZE (16 * 1024)
+// maximum number of unacknowledged bytes per TCP stream
+#define TUNNEL_STREAM_WINDOW (4 * TUNNEL_CHUNK_SIZE)
+#define TUNNEL_UDP_IDLE_TIMEOUT_MS 30000
+#define TUNNEL_STREAM_STALL_TIMEOUT_MS 15000
+#define TUNNEL_KEEPALIVE_INTERVAL_MS 1000
+// an unanswered expose request is repeated, and the tunnel dropped after the last attempt
+#define TUNNEL_EXPOSE_RETRY_MS 1000
+#define TUNNEL_EXPOSE_ATTEMPTS_MAX 5
+
+typedef enum {
+  TUNNEL_PROTO_TCP,
+  TUNNEL_PROTO_UDP,
+} TunnelProtocol;
+
+// the receive buffer (in payload bytes) the udp socket was granted by the
+// kernel; the peers are assumed to run with a buffer of the same size
+//
+// limits the data all tcp streams together keep in flight to it
+void tunnel_set_receive_buffer(size_t receive_buffer_size);
+
+// `service_port` and `listen_port` are regular (host byte order) port numbers,
+// `peer` must be the address of a connected peer
+//
+// returns -1 on error (errno is set), or the id of the new tunnel
+int tunnel_expose(
+  int udp_socket, const struct sockaddr_in *peer, TunnelProtocol protocol,
+  uint16_t service_port, uint16_t listen_port, FILE *logger
+);
+
+// closes a tunnel this daemon exposed (with its streams) and tells the peer
+// returns -1 on error (errno is set), 0 on success
+int tunnel_unexpose(int udp_socket, uint32_t id);
+
+// handles a packet starting with "tunnel-" received from a connected peer
+void tunnel_handle_peer_packet(
+  int udp_socket, const char *packet, size_t packet_len,
+  const struct sockaddr_in *peer, FILE *logger
+);
+
+// appends the local sockets of every tunnel to `fds`
+// returns the number of entries written
+size_t tunnel_fill_pollfds(struct pollfd *fds, size_t max_count);
+// services every entry of `fds` that belongs to a tunnel and has revents set
+void tunnel_handle_pollfds(int udp_socket, struct pollfd *fds, size_t count, FILE *logger);
+
+// repeats (or gives up) unanswered expose requests, and closes the streams
+// that timed out (call this at least once per second)
+void tunnel_tick(int udp_socket, FILE *logger);
+
+// writes one line of statistics (throughput, forwarding latency) per tunnel
+// returns the number of bytes written (excluding the null byte)
+size_t tunnel_format_stats(char *buffer, size_t buffer_size);
+
+// tears down every tunnel, notifying the peers involved
+void tunnel_shutdown(int udp_socket);